@@ -0,0 +1,104 @@
+/**
+ * Helpers shared by the benchmarks: building throwaway file trees and timing
+ * things. Every benchmark is a standalone program that #includes the sources
+ * it exercises, just like the tests do.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FANOUT 1000   /* Files per directory in a generated tree */
+
+/* Where the operations being measured report their progress */
+static Progress bench_progress;
+
+/* Workers would ask the UI to redraw, there's no UI here */
+void
+queue_master_update(int type, const char *path)
+{
+}
+
+/* Seconds elapsed since start */
+static inline double
+bench_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Create a file of the given size, filled with junk */
+static inline int
+bench_mkfile(const char *path, size_t size)
+{
+	static char junk[64 * 1024];
+	size_t chunk;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		return -1;
+	}
+	for (; size > 0; size -= chunk) {
+		chunk = size > sizeof(junk) ? sizeof(junk) : size;
+		if (write(fd, junk, chunk) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/* Populate root with count files of up to maxsize bytes each, spread over
+ * subdirectories of BENCH_FANOUT files */
+static inline int
+bench_mktree(const char *root, unsigned count, size_t maxsize)
+{
+	char path[4096];
+	unsigned i;
+
+	if (mkdir(root, 0755) < 0) {
+		return -1;
+	}
+
+	srand(count);
+	for (i=0; i<count; i++) {
+		if (i % BENCH_FANOUT == 0) {
+			sprintf(path, "%s/d%u", root, i / BENCH_FANOUT);
+			if (mkdir(path, 0755) < 0) {
+				return -1;
+			}
+		}
+		sprintf(path, "%s/d%u/f%u", root, i / BENCH_FANOUT, i);
+		if (bench_mkfile(path, maxsize ? rand() % (maxsize + 1) : 0) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Create a scratch directory to build trees in */
+static inline char *
+bench_scratch()
+{
+	static char tmpl[4096];
+	const char *tmpdir;
+
+	if (!(tmpdir = getenv("TMPDIR"))) {
+		tmpdir = "/tmp";
+	}
+	sprintf(tmpl, "%s/sheriff-bench.XXXXXX", tmpdir);
+	return mkdtemp(tmpl);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * Copy a big file with the regular sendfile() backend, then in bulk mode, and
+ * compare how much of the source and destination each leaves in the page cache.
+ * Usage: bench_cache [file size in MiB]
+ */
+#include "../src/fileops.c"
+#include "../src/hash.c"
+#include "../src/journal.c"
+#include "../src/perms.c"
+#include "../src/uring.c"
+#include "../src/utils.c"
+#include "../src/verify.c"
+#include "../src/walk.c"
+#include "bench.h"
+#include <sys/mman.h>
+
+/* Bytes of a file currently sitting in the page cache */
+static size_t
+cached(const char *path)
+{
+	unsigned char *vec;
+	struct stat st;
+	size_t pages, i, count;
+	long pagesize;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 ||
+	    st.st_size == 0) {
+		return 0;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	pages = (st.st_size + pagesize - 1) / pagesize;
+	vec = safealloc(pages);
+	count = 0;
+	if (!mincore(map, st.st_size, vec)) {
+		for (i=0; i<pages; i++) {
+			count += vec[i] & 1;
+		}
+	}
+
+	free(vec);
+	munmap(map, st.st_size);
+	return count * pagesize;
+}
+
+/* Write the file back and drop it from the cache, to start from a clean slate */
+static void
+uncache(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void
+run(const char *name, char *src, char *dest, off_t bulk_size)
+{
+	struct timespec start;
+	double secs;
+	size_t size;
+
+	uncache(src);
+	m_opts.bulk_size = bulk_size;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	copy_file(src, dest, &bench_progress);
+	size = cached(src) + cached(dest);
+	secs = bench_elapsed(&start);
+
+	printf("%-10s %.2f s, %zu MiB left in the page cache\n",
+	       name, secs, size / (1024 * 1024));
+	delete_file(dest, &bench_progress);
+}
+
+int
+main(int argc, char *argv[])
+{
+	Fileopts opts = { .threads = 1 };
+	char *root, *src, *dest;
+	size_t size;
+
+	size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 512) * 1024 * 1024;
+
+	fileops_init(&opts);
+	progress_init(&bench_progress);
+
+	if (!(root = bench_scratch())) {
+		perror("mkdtemp");
+		return 1;
+	}
+	src = join_path(root, "src");
+	dest = join_path(root, "dest");
+
+	printf("Creating a %zu MiB file in %s\n", size / (1024 * 1024), src);
+	if (bench_mkfile(src, size) < 0) {
+		perror("bench_mkfile");
+		return 1;
+	}
+
+	run("cached", src, dest, 0);
+	run("bulk", src, dest, 1);
+
+	delete_file(src, &bench_progress);
+	rmdir(root);
+	free(src);
+	free(dest);
+	progress_deinit(&bench_progress);
+	return 0;
+}
@@ -0,0 +1,88 @@
+/**
+ * Copy a tree of many small files with the classic sendfile() backend, then
+ * with the io_uring one, and compare the two.
+ * Usage: bench_copy [file count] [max file size]
+ */
+#include "../src/fileops.c"
+#include "../src/hash.c"
+#include "../src/journal.c"
+#include "../src/perms.c"
+#include "../src/uring.c"
+#include "../src/utils.c"
+#include "../src/verify.c"
+#include "../src/walk.c"
+#include "bench.h"
+
+static double
+run(const char *name, char *src, char *dest)
+{
+	struct timespec start;
+	double secs;
+
+	bench_progress.obj_done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	copy_file(src, dest, &bench_progress);
+	secs = bench_elapsed(&start);
+
+	printf("%-10s %u objects in %.2f s (%.0f objects/s)\n",
+	       name, bench_progress.obj_done, secs, bench_progress.obj_done / secs);
+
+	return secs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Fileopts opts = { .threads = 4 };
+	char *root, *src, *dest;
+	unsigned count;
+	size_t maxsize;
+	int uring_ok;
+	double classic, batched;
+
+	count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	maxsize = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+
+	fileops_init(&opts);
+	progress_init(&bench_progress);
+	uring_ok = m_uring_ok;
+
+	if (!(root = bench_scratch())) {
+		perror("mkdtemp");
+		return 1;
+	}
+	src = join_path(root, "src");
+
+	printf("Creating %u files of up to %zu bytes in %s\n", count, maxsize, src);
+	if (bench_mktree(src, count, maxsize)) {
+		perror("bench_mktree");
+		return 1;
+	}
+	sync();
+
+	/* Warm the cache up so that both runs start from the same state */
+	enumerate_dir(src);
+
+	m_uring_ok = 0;
+	dest = join_path(root, "sendfile");
+	classic = run("sendfile", src, dest);
+	delete_file(dest, &bench_progress);
+	free(dest);
+
+	if (uring_ok) {
+		m_uring_ok = 1;
+		dest = join_path(root, "uring");
+		batched = run("io_uring", src, dest);
+		delete_file(dest, &bench_progress);
+		free(dest);
+		printf("speedup: %.2fx\n", classic / batched);
+	} else {
+		printf("io_uring not supported by this kernel, skipping\n");
+	}
+
+	delete_file(src, &bench_progress);
+	rmdir(root);
+	free(src);
+	progress_deinit(&bench_progress);
+	return 0;
+}
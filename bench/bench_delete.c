@@ -0,0 +1,113 @@
+/**
+ * Delete a tree of many small files the way sheriff used to, recursing with
+ * a path per node, then with the serial walker, then with the parallel one,
+ * and compare them.
+ * Usage: bench_delete [file count] [threads]
+ */
+#include "../src/fileops.c"
+#include "../src/hash.c"
+#include "../src/journal.c"
+#include "../src/perms.c"
+#include "../src/uring.c"
+#include "../src/utils.c"
+#include "../src/verify.c"
+#include "../src/walk.c"
+#include "bench.h"
+
+/* The recursive delete the walkers replaced: an lstat(), an opendir() and a
+ * joined path for every node, and a UI update for every file */
+static int
+baseline_delete(char *name, Progress *pr)
+{
+	DIR *dp;
+	struct dirent *ep;
+	char *subpath;
+	struct stat st;
+
+	lstat(name, &st);
+	progress_name(pr, name);
+
+	if (S_ISDIR(st.st_mode) && (dp = opendir(name))) {
+		while ((ep = readdir(dp))) {
+			if (!is_dot_or_dotdot(ep->d_name)) {
+				subpath = join_path(name, ep->d_name);
+				baseline_delete(subpath, pr);
+				free(subpath);
+			}
+		}
+		closedir(dp);
+	}
+
+	if (remove(name) < 0) {
+		return errno;
+	}
+
+	pthread_mutex_lock(&pr->mutex);
+	pr->obj_done++;
+	pthread_mutex_unlock(&pr->mutex);
+	queue_master_update(UPDATE_STATUS, NULL);
+
+	return 0;
+}
+
+static double
+run(const char *name, char *path, unsigned count, int threads,
+    int (*delete)(char *, Progress *))
+{
+	struct timespec start;
+	double secs;
+
+	printf("Creating %u empty files in %s\n", count, path);
+	if (bench_mktree(path, count, 0)) {
+		perror("bench_mktree");
+		exit(1);
+	}
+	sync();
+
+	m_opts.threads = threads;
+	bench_progress.obj_done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (delete(path, &bench_progress)) {
+		fprintf(stderr, "%s: delete failed\n", name);
+	}
+	secs = bench_elapsed(&start);
+
+	printf("%-10s %u objects in %.2f s (%.0f objects/s)\n",
+	       name, bench_progress.obj_done, secs, bench_progress.obj_done / secs);
+
+	return secs;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Fileopts opts = { .threads = 1 };
+	char *root, *path;
+	unsigned count;
+	int threads;
+	double baseline, serial, parallel;
+
+	count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	threads = argc > 2 ? atoi(argv[2]) : 4;
+
+	fileops_init(&opts);
+	progress_init(&bench_progress);
+
+	if (!(root = bench_scratch())) {
+		perror("mkdtemp");
+		return 1;
+	}
+	path = join_path(root, "tree");
+
+	baseline = run("baseline", path, count, 1, baseline_delete);
+	serial = run("serial", path, count, 1, delete_file);
+	parallel = run("parallel", path, count, threads, delete_file);
+	printf("serial walker speedup: %.2fx\n", baseline / serial);
+	printf("speedup with %d threads: %.2fx (%.2fx over the baseline)\n",
+	       threads, serial / parallel, baseline / parallel);
+
+	rmdir(root);
+	free(path);
+	progress_deinit(&bench_progress);
+	return 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * Measure how long listing a directory and previewing a file take while a big
+ * copy hammers the same disk, first with the copy running at the same priority
+ * as the UI, then with the priorities workers get from fileops_worker_init().
+ * The previewed files are dropped from the cache beforehand, so that they have
+ * to be read from the disk. I/O priorities only matter to the I/O schedulers
+ * that honour them, like bfq: with none or mq-deadline, expect no difference.
+ * Usage: bench_listing [copy size in MiB] [files in the listed directory]
+ */
+#include "../src/fileops.c"    /* First, it asks for _GNU_SOURCE */
+#include "../src/dir.c"
+#include "../src/hash.c"
+#include "../src/journal.c"
+#include "../src/perms.c"
+#include "../src/uring.c"
+#include "../src/utils.c"
+#include "../src/verify.c"
+#include "../src/walk.c"
+#include "bench.h"
+#include <pthread.h>
+
+#define SAMPLES 50
+#define SAMPLE_INTERVAL 50000   /* us between samples */
+#define PREVIEW_LEN (64 * 1024)
+
+struct copier {
+	char *src, *dest;
+	int lower;                  /* Lower the priority of the copying thread */
+	pthread_t thread;
+};
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Copy src to dest over and over, until cancelled */
+static void *
+copier_run(void *arg)
+{
+	struct copier *c = arg;
+
+	if (c->lower) {
+		fileops_worker_init();
+	}
+	while (!progress_check(&bench_progress)) {
+		copy_file(c->src, c->dest, &bench_progress);
+		delete_file(c->dest, &bench_progress);
+	}
+	return NULL;
+}
+
+/* List dir and preview one of its files, the way the UI does when moving the
+ * highlight around. Returns how long it took, in ms */
+static double
+sample(const char *dir, int count, int i)
+{
+	static char buf[PREVIEW_LEN];
+	struct timespec start;
+	Direntry *listing = NULL;
+	char name[32];
+	char *path;
+	int fd;
+
+	sprintf(name, "f%d", i % count);
+	path = join_path(dir, name);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_listing(&listing, dir);
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (read(fd, buf, sizeof(buf)) < 0) {
+			perror("read");
+		}
+		close(fd);
+	}
+	free_listing(&listing);
+	free(path);
+
+	return bench_elapsed(&start) * 1000;
+}
+
+static void
+run(const char *name, const char *dir, int count, struct copier *c)
+{
+	double lat[SAMPLES];
+	int i;
+
+	progress_control(&bench_progress, PROGRESS_RUN);
+	if (c) {
+		pthread_create(&c->thread, NULL, copier_run, c);
+		usleep(500000);     /* Let the copy get going */
+	}
+
+	for (i=0; i<SAMPLES; i++) {
+		lat[i] = sample(dir, count, i);
+		usleep(SAMPLE_INTERVAL);
+	}
+
+	if (c) {
+		progress_control(&bench_progress, PROGRESS_CANCEL);
+		pthread_join(c->thread, NULL);
+		progress_control(&bench_progress, PROGRESS_RUN);
+		delete_file(c->dest, &bench_progress);
+	}
+
+	qsort(lat, SAMPLES, sizeof(*lat), cmp_double);
+	printf("%-10s median %7.2f ms, p90 %7.2f ms, max %7.2f ms\n", name,
+	       lat[SAMPLES / 2], lat[SAMPLES * 9 / 10], lat[SAMPLES - 1]);
+}
+
+int
+main(int argc, char *argv[])
+{
+	Fileopts opts = { .threads = 4, .nice = 10, .ioclass = IOCLASS_IDLE };
+	struct copier c;
+	char *root, *dir, *path;
+	char name[32];
+	size_t size;
+	int count, i;
+
+	size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 1024) * 1024 * 1024;
+	count = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000;
+
+	fileops_init(&opts);
+	progress_init(&bench_progress);
+
+	if (!(root = bench_scratch())) {
+		perror("mkdtemp");
+		return 1;
+	}
+	dir = join_path(root, "listed");
+	c.src = join_path(root, "big");
+	c.dest = join_path(root, "copy");
+
+	printf("Creating %d files of %d bytes and a %zu MiB file in %s\n", count,
+	       PREVIEW_LEN, size / (1024 * 1024), root);
+	if (mkdir(dir, 0755) < 0 || bench_mkfile(c.src, size) < 0) {
+		perror("creating files");
+		return 1;
+	}
+	for (i=0; i<count; i++) {
+		sprintf(name, "f%d", i);
+		path = join_path(dir, name);
+		if (bench_mkfile(path, PREVIEW_LEN) < 0) {
+			perror("bench_mkfile");
+			return 1;
+		}
+		free(path);
+	}
+	sync();
+
+	run("idle", dir, count, NULL);
+	c.lower = 0;
+	run("same prio", dir, count, &c);
+	c.lower = 1;
+	run("lowered", dir, count, &c);
+
+	delete_file(root, &bench_progress);
+	free(dir);
+	free(c.src);
+	free(c.dest);
+	progress_deinit(&bench_progress);
+	return 0;
+}
@@ -1,28 +1,103 @@
-#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "clipboard.h"
 #include "dir.h"
 #include "fileops.h"
+#include "jobs.h"
+#include "journal.h"
+#include "perms.h"
 #include "sheriff.h"
+#include "trash.h"
+#include "undo.h"
 #include "utils.h"
 #include "ui.h"
 
-/* Struct that gets passed to a thread by reference */
-struct pthr_clip_arg {
-	Clipboard *clip;
-	char *destpath;
+#define CLIP_MAGIC "sheriff\001"
+
+/* Layout of the shared clipboard: this header, then every group as a
+ * clip_shared_group, followed by its offsets, names and path */
+struct clip_shared {
+	char magic[8];
+	int op;
+	int ngroups;
 };
 
-static int  clip_clear(Clipboard *clip);
-static int  clip_clone(Clipboard *dest, Clipboard *src);
-static void* pthr_clip_exec(void *arg);
+struct clip_shared_group {
+	unsigned count;
+	unsigned namelen;
+	unsigned pathlen;   /* Terminator included */
+};
+
+static int        clip_clear(Clipboard *clip);
+static void       clip_done(Progress *pr, int err);
+static int        clip_file(int op, const char *dir, const char *name,
+                            char *destpath, const Perms *perms, Undo *undo,
+                            Progress *pr);
+static Clipgroup* clip_group(const char *path, int count, size_t namelen);
+static void       clip_group_add(Clipgroup *g, const char *name);
+static void       clip_group_put(Clipgroup *g);
+static Cliplist*  clip_list(int ngroups);
+static void       clip_list_put(Cliplist *list);
+static int        clip_preflight(const Clipboard *clip, const char *destpath,
+                                 Progress *pr);
+static Clipgroup* clip_selection(Direntry *dir);
+static int        clip_unpack(const char *buf, size_t len, Cliplist **list,
+                              int *op);
 
 static Clipboard m_clip;
+static char m_shared[PATH_MAX];     /* The shared clipboard, empty if none */
+static struct stat m_seen;          /* What it was when last read or written */
+
+/* Add the files selected in dir to the clipboard, in place of any that were
+ * taken from there before, and make op what's to be done to all of them.
+ * Returns how many files the clipboard holds */
+int
+clip_add(Direntry *dir, int op)
+{
+	Cliplist *list, *old;
+	Clipgroup *g;
+	int i, count;
+
+	g = clip_selection(dir);
+
+	/* Lists are shared with the jobs, so it's a new one, reusing the groups */
+	pthread_mutex_lock(&m_clip.mutex);
+	old = m_clip.list;
+	list = clip_list((old ? old->ngroups : 0) + 1);
+	for (i=0; old && i<old->ngroups; i++) {
+		if (g && !strcmp(old->groups[i]->path, g->path)) {
+			continue;
+		}
+		__atomic_add_fetch(&old->groups[i]->refs, 1, __ATOMIC_RELAXED);
+		list->groups[list->ngroups++] = old->groups[i];
+		list->count += old->groups[i]->count;
+	}
+	if (g) {
+		list->groups[list->ngroups++] = g;
+		list->count += g->count;
+	}
+	if (!list->count) {
+		clip_list_put(list);
+		list = NULL;
+	}
+	m_clip.list = list;
+	m_clip.op = op;
+	count = (list ? list->count : 0);
+	pthread_mutex_unlock(&m_clip.mutex);
+
+	clip_list_put(old);
+	return count;
+}
 
 /* Change the operation stored in the clipboard. Useful when a yank becomes a
  * delete (aka yank_cur -> link_cur should make OP_COPY become OP_LINK) */
@@ -42,35 +117,265 @@ clip_deinit()
 	return 0;
 }
 
-/* Spawn a thread that will execute what the clipboard is holding */
+/* Queue a job that will execute what the clipboard is holding */
 int
 clip_exec(char *destpath)
 {
-	struct pthr_clip_arg *arg;
-	pthread_attr_t wt_attr;
-	pthread_t thr;
-
-	arg = safealloc(sizeof(*arg));
-
-	arg->clip = safealloc(sizeof(Clipboard));   /* Cobble up the thread args */
-	clip_clone(arg->clip, &m_clip);
-	arg->destpath = safealloc(sizeof(*arg->destpath) * (strlen(destpath) + 1));
-	sprintf(arg->destpath, "%s", destpath);
+	Clipboard *clip;
+	char *dest;
 
-	pthread_attr_init(&wt_attr);    /* Start the thread as a detached thread */
-	pthread_attr_setdetachstate(&wt_attr, PTHREAD_CREATE_DETACHED);
-	pthread_create(&thr, &wt_attr, pthr_clip_exec, arg);
-	pthread_attr_destroy(&wt_attr);
+	/* The job gets a snapshot of its own, sharing the list */
+	clip = safealloc(sizeof(*clip));
+	pthread_mutex_lock(&m_clip.mutex);
+	clip->op = m_clip.op;
+	if ((clip->list = m_clip.list)) {
+		__atomic_add_fetch(&clip->list->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&m_clip.mutex);
+	dest = safealloc(sizeof(*dest) * (strlen(destpath) + 1));
+	strcpy(dest, destpath);
 
+	job_submit(clip, dest);
 	return 0;
 }
 
-/* Initialize a clipboard object to null */
+/* Free a clipboard snapshot, as taken by clip_exec() */
+void
+clip_free(Clipboard *clip)
+{
+	clip_list_put(clip->list);
+	free(clip);
+}
+
+/* Initialize a clipboard object to null, and to be shared with the other
+ * instances if shared is set */
 int
-clip_init()
+clip_init(int shared)
 {
+	const char *dir;
+	int len;
+
 	memset(&m_clip, '\0', sizeof(m_clip));
 	pthread_mutex_init(&m_clip.mutex, NULL);
+
+	memset(&m_seen, '\0', sizeof(m_seen));
+	*m_shared = '\0';
+	if (!shared) {
+		return 0;
+	}
+	if ((dir = getenv("XDG_RUNTIME_DIR")) && *dir) {
+		len = snprintf(m_shared, sizeof(m_shared), "%s/sheriff-clipboard", dir);
+	} else {
+		len = snprintf(m_shared, sizeof(m_shared), "/tmp/sheriff-clipboard-%u",
+		               (unsigned)getuid());
+	}
+	if (len < 0 || len >= (int)sizeof(m_shared) - 8) {
+		*m_shared = '\0';  /* No room for the mkstemp() suffix */
+		return ENAMETOOLONG;
+	}
+	return 0;
+}
+
+/* Share what the clipboard holds with the other instances, if it's shared */
+int
+clip_publish()
+{
+	struct clip_shared hdr;
+	struct clip_shared_group sg;
+	char tmp[PATH_MAX];
+	const Clipgroup *g;
+	FILE *fp;
+	int fd, i, err;
+
+	if (!*m_shared) {
+		return 0;
+	}
+	strcpy(tmp, m_shared);  /* clip_init() left room for the suffix */
+	strcat(tmp, ".XXXXXX");
+	if ((fd = mkstemp(tmp)) < 0) {
+		return errno;
+	}
+	if (!(fp = fdopen(fd, "w"))) {
+		err = errno;
+		close(fd);
+		unlink(tmp);
+		return err;
+	}
+
+	pthread_mutex_lock(&m_clip.mutex);
+	memset(&hdr, '\0', sizeof(hdr));
+	memcpy(hdr.magic, CLIP_MAGIC, sizeof(hdr.magic));
+	hdr.op = m_clip.op;
+	hdr.ngroups = (m_clip.list ? m_clip.list->ngroups : 0);
+	err = (fwrite(&hdr, sizeof(hdr), 1, fp) != 1);
+	for (i=0; i<hdr.ngroups && !err; i++) {
+		g = m_clip.list->groups[i];
+		sg.count = g->count;
+		sg.namelen = (g->count ? g->offs[g->count - 1] +
+		              strlen(CLIP_NAME(g, g->count - 1)) + 1 : 0);
+		sg.pathlen = strlen(g->path) + 1;
+		err = (fwrite(&sg, sizeof(sg), 1, fp) != 1 ||
+		       fwrite(g->offs, sizeof(*g->offs), sg.count, fp) != sg.count ||
+		       fwrite(g->names, 1, sg.namelen, fp) != sg.namelen ||
+		       fwrite(g->path, 1, sg.pathlen, fp) != sg.pathlen);
+	}
+	pthread_mutex_unlock(&m_clip.mutex);
+
+	/* No need to read back our own, once it's in place */
+	err = (err || fflush(fp) || fstat(fd, &m_seen) < 0);
+	if (fclose(fp) || err || rename(tmp, m_shared) < 0) {
+		unlink(tmp);
+		return EIO;
+	}
+	return 0;
+}
+
+/* Take over what another instance has published, if it's published anything
+ * since this one last looked */
+int
+clip_pull()
+{
+	Cliplist *list, *old;
+	struct stat st;
+	char *map;
+	int fd, op, err;
+
+	if (!*m_shared ||
+	    (fd = open(m_shared, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+		return 0;
+	}
+	/* Only trust what's been written by the user sheriff runs as */
+	if (fstat(fd, &st) < 0 || st.st_uid != getuid() || st.st_mode & 022 ||
+	    (st.st_dev == m_seen.st_dev && st.st_ino == m_seen.st_ino &&
+	     st.st_size == m_seen.st_size &&
+	     st.st_mtim.tv_sec == m_seen.st_mtim.tv_sec &&
+	     st.st_mtim.tv_nsec == m_seen.st_mtim.tv_nsec)) {
+		close(fd);
+		return 0;
+	}
+	m_seen = st;
+
+	map = (st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+	                             fd, 0) : MAP_FAILED);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return EINVAL;
+	}
+	err = clip_unpack(map, st.st_size, &list, &op);
+	munmap(map, st.st_size);
+	if (err) {
+		return err;
+	}
+
+	pthread_mutex_lock(&m_clip.mutex);
+	old = m_clip.list;
+	m_clip.list = list;
+	m_clip.op = op;
+	pthread_mutex_unlock(&m_clip.mutex);
+
+	clip_list_put(old);
+	return 0;
+}
+
+/* Queue a job purging a trash, unless there's one waiting to already. The
+ * clipboard is left alone: a purge is about the whole trash, not its files */
+int
+clip_purge(const char *trash)
+{
+	Clipboard *clip;
+	Job *job;
+	char *dest;
+
+	for (job = jobs_lock(); job; job = job->next) {
+		if (job->state == JOB_QUEUED && job->clip &&
+		    job->clip->op == OP_PURGE && !strcmp(job->destpath, trash)) {
+			break;
+		}
+	}
+	jobs_unlock();
+	if (job) {
+		return 0;
+	}
+
+	clip = safealloc(sizeof(*clip));
+	memset(clip, '\0', sizeof(*clip));
+	clip->op = OP_PURGE;
+	dest = safealloc(sizeof(*dest) * (strlen(trash) + 1));
+	strcpy(dest, trash);
+
+	job_submit(clip, dest);
+	return 0;
+}
+
+/* Queue the job a journal left behind by an earlier run, with the job taking
+ * the journal over. The clipboard is left alone */
+int
+clip_resume(Journal *journal)
+{
+	Clipboard *clip;
+	Cliplist *list;
+	Clipgroup *g;
+	char *dest;
+	size_t len;
+	int i, d, count;
+
+	if (journal->op != OP_COPY && journal->op != OP_MOVE &&
+	    journal->op != OP_SYNC && journal->op != OP_DELETE) {
+		journal_close(journal, 0);
+		return EINVAL;
+	}
+
+	/* All the items, done or not, so that they're where the journal says */
+	list = clip_list(journal->ndirs);
+	for (d=0; d<journal->ndirs; d++) {
+		for (i=0, count=0, len=0; i<journal->count; i++) {
+			if (journal->dirof[i] == d) {
+				count++;
+				len += strlen(journal->names[i]) + 1;
+			}
+		}
+		g = clip_group(journal->dirs[d], count, len);
+		for (i=0; i<journal->count; i++) {
+			if (journal->dirof[i] == d) {
+				clip_group_add(g, journal->names[i]);
+			}
+		}
+		list->groups[list->ngroups++] = g;
+		list->count += g->count;
+	}
+
+	clip = safealloc(sizeof(*clip));
+	memset(clip, '\0', sizeof(*clip));
+	clip->op = journal->op;
+	clip->list = list;
+	dest = safealloc(sizeof(*dest) * (strlen(journal->dest) + 1));
+	strcpy(dest, journal->dest);
+
+	job_resume(clip, dest, journal);
+	return 0;
+}
+
+/* Queue a job taking back the latest batch of the undo log. Returns ENOENT if
+ * there's nothing to undo */
+int
+clip_undo()
+{
+	char path[PATH_MAX];
+	Clipboard *clip;
+	char *dest;
+	int err;
+
+	if ((err = undo_claim(path))) {
+		return err;
+	}
+
+	clip = safealloc(sizeof(*clip));
+	memset(clip, '\0', sizeof(*clip));
+	clip->op = OP_UNDO;
+	dest = safealloc(sizeof(*dest) * (strlen(path) + 1));
+	strcpy(dest, path);
+
+	job_submit(clip, dest);
 	return 0;
 }
 
@@ -81,151 +386,369 @@ clip_update(Direntry* dir, int op)
 	/* Overwrite the clipboard contents, if any */
 	clip_clear(&m_clip);
 
-	m_clip.op = op;
-	snapshot_tree_selected(&m_clip.dir, dir);
+	clip_add(dir, op);
 	return 0;
 }
 
+/* Execute the action specified in a clipboard over the files in the
+ * clipboard, reporting to pr. Runs on behalf of a job, see jobs.c */
+int
+clip_run(Clipboard *clip, char *destpath, Progress *pr)
+{
+	char skipped[HUMANSIZE_LEN+1];
+	const Clipgroup *g;
+	unsigned count;
+	int i, j, k, err, status;
+	Perms perms;
+	Undo *undo;
+
+	/* NOTE: destpath here is improperly named, as it can also contain the
+	 * permissions and owner to give to the files, see perms.h. This isn't too
+	 * bad, since a chmod doesn't need a destpath */
+	status = 0;
+
+	if (clip->op == OP_PURGE) {
+		return trash_purge(destpath, pr);
+	}
+	if (clip->op == OP_UNDO) {
+		return undo_run(destpath, pr);
+	}
+
+	/* No need to count the files beforehand: the operations themselves add
+	 * to the total as they discover new files. A resumed job is partly there
+	 * already, so there's no telling what it needs */
+	if (clip->list && (clip->op == OP_COPY || clip->op == OP_MOVE) &&
+	    !journal_resumed(pr->journal)) {
+		status = clip_preflight(clip, destpath, pr);
+	}
+	if (clip->list && clip->op == OP_CHMOD && !status) {
+		status = perms_parse(&perms, destpath);
+	}
+	if (status) {
+		return status;
+	}
+
+	/* Execute whatever the clipboard is holding, on every file the clipboard is
+	 * holding, unless the job gets cancelled halfway: a file that fails doesn't
+	 * stop the others. Items are numbered across the groups, the way the
+	 * journal has them. What a move got to before being cancelled can be
+	 * undone all the same */
+	undo = (clip->list && clip->op == OP_MOVE ? undo_new(OP_MOVE) : NULL);
+	for (j=0, i=0; clip->list && j<clip->list->ngroups; j++) {
+		g = clip->list->groups[j];
+		for (k=0; k<g->count; k++, i++) {
+			if (progress_check(pr)) {
+				break;
+			}
+			if (journal_item(pr->journal, i) == JOURNAL_DONE) {
+				continue;
+			}
+			err = clip_file(clip->op, g->path, CLIP_NAME(g, k), destpath,
+			                &perms, undo, pr);
+			clip_done(pr, err);
+			status |= err;
+			progress_name(pr, NULL);
+		}
+	}
+	undo_commit(undo);
+
+	/* Most of a sync can be over before there's anything to see */
+	if (clip->list && clip->op == OP_SYNC && !status) {
+		count = __atomic_load_n(&pr->skipped, __ATOMIC_RELAXED);
+		tohuman(__atomic_load_n(&pr->skipped_bytes, __ATOMIC_RELAXED),
+		        skipped);
+		progress_error(pr, "Sync done, %u files (%s) were up to date",
+		               count, skipped);
+	}
+
+	/* One sync for the whole job is way cheaper than one per file, and still
+	 * makes sure nothing is lost once the job is reported as done */
+	if (fileop_opts()->durability == DURABLE_BATCH && clip->list &&
+	    (clip->op == OP_COPY || clip->op == OP_MOVE || clip->op == OP_LINK ||
+	     clip->op == OP_SYNC)) {
+		status |= file_syncfs(destpath);
+	}
+
+	return status;
+}
 /* Static functions {{{*/
 /* Clear a clipboard object */
 int
 clip_clear(Clipboard *clip)
 {
+	Cliplist *list;
+
 	pthread_mutex_lock(&clip->mutex);
-	if (clip->dir) {
-		free_listing(&clip->dir);
-		clip->dir = NULL;
-	}
+	list = clip->list;
+	clip->list = NULL;
 	clip->op = 0;
 	pthread_mutex_unlock(&clip->mutex);
+
+	clip_list_put(list);
 	return 0;
 }
 
-/* Clone a clipboard */
+/* Note in the job's journal that the current item is done with, unless err
+ * says otherwise */
+void
+clip_done(Progress *pr, int err)
+{
+	if (!err) {
+		journal_mark(pr->journal);
+	}
+}
+
+/* Do op to the file name in dir, towards destpath if it goes anywhere, noting
+ * in undo where it went if it's moved somewhere that was free */
 int
-clip_clone(Clipboard *dest, Clipboard *src)
+clip_file(int op, const char *dir, const char *name, char *destpath,
+          const Perms *perms, Undo *undo, Progress *pr)
 {
-	dest->op = src->op;
+	char *src, *dest;
+	struct stat st;
+	int err, merged;
 
-	pthread_mutex_lock(&src->mutex);
-	assert(!snapshot_tree_selected(&dest->dir, src->dir));
-	pthread_mutex_unlock(&src->mutex);
+	src = join_path(dir, name);
+	dest = (op == OP_DELETE || op == OP_CHMOD ? NULL :
+	        join_path(destpath, name));
 
-	return 0;
+	switch (op) {
+	case OP_COPY:
+		/* What a resumed copy got to already needn't be redone */
+		if (journal_resumed(pr->journal)) {
+			err = sync_file(src, dest, pr);
+		} else {
+			err = copy_file(src, dest, pr);
+		}
+		break;
+	case OP_MOVE:
+		/* Moving back what was merged into something already there would
+		 * take what was there along, it can't be undone */
+		merged = (undo && !lstat(dest, &st));
+		if (!(err = move_file(src, dest, pr)) && !merged) {
+			undo_add(undo, src, dest);
+		}
+		break;
+	case OP_SYNC:
+		err = sync_file(src, dest, pr);
+		break;
+	case OP_LINK:
+		err = link_file(src, dest, pr);
+		break;
+	case OP_DELETE:
+		err = delete_file(src, pr);
+		break;
+	case OP_CHMOD:
+		err = chmod_file(src, perms, pr);
+		break;
+	default:
+		err = 0;
+		break;
+	}
+
+	free(src);
+	free(dest);
+	return err;
 }
 
-/* Execute the action specified in a clipboard over the files in the clipboard */
-void *
-pthr_clip_exec(void *arg)
+/* An empty group, with room for count files from path whose names take up
+ * namelen bytes, terminators included */
+Clipgroup *
+clip_group(const char *path, int count, size_t namelen)
 {
-	int i, status;
-	unsigned count;
-	mode_t mode;
-	char *tmpsrc, *tmpdest;
-	Progress *pr;
-	Clipboard *clip;
-	char *destpath;
+	Clipgroup *g;
 
-	/* NOTE: destpath here is improperly named, as it can also contain the
-	 * permissions to give to the files coded in octal. This isn't too bad,
-	 * since a chmod doesn't need a destpath */
-	clip = ((struct pthr_clip_arg*)arg)->clip;
-	destpath = ((struct pthr_clip_arg*)arg)->destpath;
-	status = 0;
+	g = safealloc(sizeof(*g) + sizeof(*g->offs) * count + namelen +
+	              strlen(path) + 1);
+	g->refs = 1;
+	g->offs = (unsigned*)(g + 1);
+	g->names = (char*)(g->offs + count);
+	g->path = g->names + namelen;
+	strcpy(g->path, path);
+	g->count = 0;
+	return g;
+}
+
+/* Append a name to a group, which clip_group() must have made room for */
+void
+clip_group_add(Clipgroup *g, const char *name)
+{
+	unsigned off;
 
-	/* Estimate how many files we have to work with */
-	count = 0;
-	for (i=0; i<clip->dir->count; i++) {
-		tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-		count += enumerate_dir(tmpsrc);
-		free(tmpsrc);
+	off = (g->count ? g->offs[g->count - 1] +
+	       strlen(CLIP_NAME(g, g->count - 1)) + 1 : 0);
+	g->offs[g->count++] = off;
+	strcpy(g->names + off, name);
+}
+
+/* Drop a reference to a group, freeing it if it was the last one */
+void
+clip_group_put(Clipgroup *g)
+{
+	if (!__atomic_sub_fetch(&g->refs, 1, __ATOMIC_ACQ_REL)) {
+		free(g);
 	}
+}
 
-	pr = fileop_progress();
-	pthread_mutex_lock(&pr->mutex);
-	pr->obj_count += count;
-	pthread_mutex_unlock(&pr->mutex);
+/* An empty list, with room for ngroups groups */
+Cliplist *
+clip_list(int ngroups)
+{
+	Cliplist *list;
 
-	/* Execute whatever the clipboard is holding, on every file the clipboard is
-	 * holding. Yes, I could have done a single for loop, whatever */
-	 if (clip->dir) {
-		switch(clip->op) {
-		case OP_COPY:
-			for (i=0; i<clip->dir->count; i++) {
-				tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-				tmpdest = join_path(destpath, clip->dir->tree[i]->name);
-				status |= copy_file(tmpsrc, tmpdest);
-				pthread_mutex_lock(&pr->mutex);
-				pr->fname = NULL;
-				pthread_mutex_unlock(&pr->mutex);
-				free(tmpsrc);
-				free(tmpdest);
-			}
-			break;
-		case OP_MOVE:
-			for (i=0; i<clip->dir->count; i++) {
-				tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-				tmpdest = join_path(destpath, clip->dir->tree[i]->name);
-				status |= move_file(tmpsrc, tmpdest);
-				pthread_mutex_lock(&pr->mutex);
-				pr->fname = NULL;
-				pthread_mutex_unlock(&pr->mutex);
-				free(tmpsrc);
-				free(tmpdest);
-			}
-			break;
-		case OP_LINK:
-			for (i=0; i<clip->dir->count; i++) {
-				tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-				tmpdest = join_path(destpath, clip->dir->tree[i]->name);
-				status |= link_file(tmpsrc, tmpdest);
-				pthread_mutex_lock(&pr->mutex);
-				pr->fname = NULL;
-				pthread_mutex_unlock(&pr->mutex);
-				free(tmpsrc);
-				free(tmpdest);
+	list = safealloc(sizeof(*list) + sizeof(*list->groups) * ngroups);
+	list->refs = 1;
+	list->groups = (Clipgroup**)(list + 1);
+	list->ngroups = 0;
+	list->count = 0;
+	return list;
+}
+
+/* Drop a reference to a list, freeing it if it was the last one */
+void
+clip_list_put(Cliplist *list)
+{
+	int i;
+
+	if (!list || __atomic_sub_fetch(&list->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	for (i=0; i<list->ngroups; i++) {
+		clip_group_put(list->groups[i]);
+	}
+	free(list);
+}
+
+/* Make sure that whatever the clipboard is about to copy fits in destpath, so
+ * that we fail now rather than halfway through. Moves only need space if
+ * they're across filesystems */
+int
+clip_preflight(const Clipboard *clip, const char *destpath, Progress *pr)
+{
+	struct stat st, destst;
+	const Clipgroup *g;
+	char *tmpsrc;
+	off_t need;
+	int i, j;
+
+	if (!fileop_opts()->preflight || stat(destpath, &destst) < 0) {
+		return 0;
+	}
+
+	need = 0;
+	for (j=0; j<clip->list->ngroups; j++) {
+		g = clip->list->groups[j];
+		for (i=0; i<g->count; i++) {
+			tmpsrc = join_path(g->path, CLIP_NAME(g, i));
+			if (clip->op == OP_COPY ||
+			    (!lstat(tmpsrc, &st) && st.st_dev != destst.st_dev)) {
+				need += tree_size(tmpsrc);
 			}
+			free(tmpsrc);
+		}
+	}
+
+	return need > 0 ? space_check(destpath, need, pr) : 0;
+}
+
+/* The files selected in dir, the highlighted one included, as a group. Returns
+ * NULL if dir is empty */
+Clipgroup *
+clip_selection(Direntry *dir)
+{
+	Clipgroup *g;
+	size_t len;
+	int i, count;
+
+	if (!dir || !dir->tree || !dir->count) {
+		return NULL;
+	}
+	dir->tree[dir->sel_idx]->selected = 1;
+
+	for (i=0, count=0, len=0; i<dir->count; i++) {
+		if (dir->tree[i]->selected) {
+			count++;
+			len += strlen(dir->tree[i]->name) + 1;
+		}
+	}
+	g = clip_group(dir->path, count, len);
+	for (i=0; i<dir->count; i++) {
+		if (dir->tree[i]->selected) {
+			clip_group_add(g, dir->tree[i]->name);
+		}
+	}
+	return g;
+}
+
+/* Rebuild the list in a shared clipboard, len bytes at buf, into list, NULL
+ * if it's empty. Returns EINVAL if it isn't a shared clipboard, or is broken */
+int
+clip_unpack(const char *buf, size_t len, Cliplist **list, int *op)
+{
+	struct clip_shared hdr;
+	struct clip_shared_group sg;
+	const char *offs, *names, *path;
+	Clipgroup *g;
+	size_t pos;
+	unsigned k;
+	int i;
+
+	*list = NULL;
+	if (len < sizeof(hdr)) {
+		return EINVAL;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (memcmp(hdr.magic, CLIP_MAGIC, sizeof(hdr.magic)) ||
+	    (hdr.op != OP_COPY && hdr.op != OP_MOVE) || hdr.ngroups < 0 ||
+	    (size_t)hdr.ngroups > len) {
+		return EINVAL;
+	}
+	*op = hdr.op;
+	if (!hdr.ngroups) {
+		return 0;
+	}
+
+	/* Nothing in there is trusted to be within bounds, or terminated */
+	*list = clip_list(hdr.ngroups);
+	for (i=0, pos=sizeof(hdr); i<hdr.ngroups; i++) {
+		if (len - pos < sizeof(sg)) {
 			break;
-		case OP_DELETE:
-			for (i=0; i<clip->dir->count; i++) {
-				tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-				status |= delete_file(tmpsrc);
-				pthread_mutex_lock(&pr->mutex);
-				pr->fname = NULL;
-				pthread_mutex_unlock(&pr->mutex);
-				free(tmpsrc);
-			}
+		}
+		memcpy(&sg, buf + pos, sizeof(sg));
+		pos += sizeof(sg);
+		/* Groups are never empty, nor are their names */
+		if (!sg.count || sg.count > len || !sg.namelen || sg.namelen > len ||
+		    !sg.pathlen || sg.pathlen > len ||
+		    (size_t)sg.count * sizeof(*g->offs) + sg.namelen + sg.pathlen >
+		    len - pos) {
 			break;
-		case OP_CHMOD:
-			mode = atoo(destpath);  /* Convert from octal string to int */
-			if (mode > 0) {
-				for (i=0; i<clip->dir->count; i++) {
-					tmpsrc = join_path(clip->dir->path, clip->dir->tree[i]->name);
-					status |= chmod_file(tmpsrc, mode);
-					pthread_mutex_lock(&pr->mutex);
-					pr->fname = NULL;
-					pthread_mutex_unlock(&pr->mutex);
-					free(tmpsrc);
-				}
-			}
+		}
+		offs = buf + pos;
+		names = offs + sg.count * sizeof(*g->offs);
+		path = names + sg.namelen;
+		pos += sg.count * sizeof(*g->offs) + sg.namelen + sg.pathlen;
+		if (path[sg.pathlen - 1] != '\0' || names[sg.namelen - 1] != '\0') {
 			break;
-		default:
+		}
+
+		g = clip_group(path, sg.count, sg.namelen);
+		memcpy(g->offs, offs, sg.count * sizeof(*g->offs));
+		memcpy(g->names, names, sg.namelen);
+		g->count = sg.count;
+		for (k=0; k<sg.count && g->offs[k] < sg.namelen; k++)
+			;
+		(*list)->groups[(*list)->ngroups++] = g;
+		(*list)->count += g->count;
+		if (k < sg.count) {
 			break;
 		}
 	}
 
-	pthread_mutex_lock(&pr->mutex);
-	pr->obj_count -= count;
-	pr->obj_done -= count;
-	pthread_mutex_unlock(&pr->mutex);
-
-	free(destpath);
-	/* Signal the main thread that the current directory contents have changed */
-	queue_master_update();
-	/* arg was passed on the heap to prevent it being overwritten */
-	free_listing(&clip->dir);
-	free(clip);
-	free(arg);
-	return NULL;
+	if (i < hdr.ngroups) {
+		clip_list_put(*list);
+		*list = NULL;
+		return EINVAL;
+	}
+	return 0;
 }
 /*}}}*/
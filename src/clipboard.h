@@ -3,6 +3,18 @@
  * A Clipboard struct contains a snapshot of the files to operate on, as well as
  * the operation to apply to these files. The mutex prevents things like a
  * deallocation from happening while a copy is in progress.
+ * The files can come from any number of directories: a yank replaces the
+ * clipboard, while clip_add() keeps what's there, and only replaces what was
+ * taken from the same directory before. The files are kept as lists of names,
+ * one per directory, rather than as copies of their listings.
+ * Executing a clipboard hands a snapshot of it over to the job scheduler, which
+ * calls clip_run() on it once it's its turn. Lists are never changed once
+ * they're built, so a snapshot is only a new reference to them.
+ * The clipboard can be shared by all the instances a user runs: yanks are
+ * published to a file in $XDG_RUNTIME_DIR, which lives in memory, replacing it
+ * with a rename. An instance about to paste maps the file back, if someone has
+ * published it since it last looked. Its layout is the groups' own, so loading
+ * a group is a couple of memcpy()s however many files it holds.
  */
 
 #ifndef FILEOPS_H
@@ -10,25 +22,60 @@
 
 #include <pthread.h>
 #include "dir.h"
+#include "fileops.h"
+#include "journal.h"
 
 enum clip_ops {
 	OP_COPY,
 	OP_MOVE,
 	OP_LINK,
 	OP_DELETE,
-	OP_CHMOD
+	OP_CHMOD,
+	OP_SYNC,
+	OP_PURGE,           /* Empty a trash down to its limits, see trash.h */
+	OP_UNDO,            /* Reverse a batch of the undo log, see undo.h */
+	OP_NR
 };
 
+/* Files yanked from one directory, all in a single allocation: the directory
+ * path is stored once, and the names back to back */
+typedef struct clipgroup {
+	unsigned refs;
+	char *path;
+	char *names;        /* NUL-terminated, one after the other */
+	unsigned *offs;     /* Where each name starts in names */
+	int count;
+} Clipgroup;
+
+/* The files in a clipboard, as groups shared with the lists built after it */
+typedef struct cliplist {
+	unsigned refs;
+	Clipgroup **groups;
+	int ngroups;
+	int count;          /* Files in all the groups */
+} Cliplist;
+
 typedef struct {
 	enum clip_ops op;
-	Direntry* dir;
+	Cliplist *list;     /* NULL if there's nothing in it */
 	pthread_mutex_t mutex;
 } Clipboard;
 
+/* Name of the i-th file in a group */
+#define CLIP_NAME(g, i) ((g)->names + (g)->offs[i])
+
+int clip_add(Direntry *dir, int op);
 int clip_change_op(enum clip_ops op);
 int clip_deinit();
 int clip_exec(char *destpath);
-int clip_init();
+void clip_free(Clipboard *clip);
+int clip_init(int shared);
+int clip_publish();
+int clip_pull();
+int clip_purge(const char *trash);
+int clip_resume(Journal *journal);
+int clip_undo();
+int clip_run(Clipboard *clip, char *destpath, Progress *pr);
 int clip_update(Direntry *dir, int op);
 
 #endif
@@ -11,6 +11,45 @@ typedef struct {
 } Assoc;
 
 static int pane_proportions[] = { 1, 4, 2 };
+static int shared_clipboard = 1;    /* Yank in one instance, paste in another */
+
+static Fileopts fileopts = {
+	.threads = 4,       /* Threads used to delete large trees */
+	.preflight = 1,     /* Make sure copies fit before starting them */
+	.bulk_size = 64 * 1024 * 1024,  /* Keep bigger files out of the cache */
+	.durability = DURABLE_BATCH,
+	.verify = 0,
+	.sync_hash = 0,     /* Syncs compare contents instead of mtimes */
+	.max_bps = 0,       /* Bytes per second all jobs together, 0=no limit */
+	.max_ops = 0,       /* Files per second all jobs together, 0=no limit */
+	.job_bps = 0,       /* Same, for every job on its own */
+	.job_ops = 0,
+	.nice = 10,         /* Jobs yield the CPU to the UI */
+	.ioclass = IOCLASS_BE,  /* and the disk, IOCLASS_IDLE to yield it to */
+	.iolevel = 7,           /* everyone else as well */
+	.trash = 1,         /* Delete to the trash, dD in the trash deletes for good */
+	.trash_size = (off_t)8 << 30,   /* Bytes, in every trash */
+	.trash_days = 30,
+	.undo = 32,         /* Moves, renames and trashings that uu can take back */
+};
+
+static Jobopts jobopts = {
+	.runners = 4,       /* Jobs running at the same time */
+	.order = JOBS_PRIORITY,
+	.keep = 16,         /* Finished jobs to keep in the jobs view */
+	.per_device = 1,    /* Jobs sharing a disk just make it seek */
+	.journal = 1,       /* Offer to resume the jobs quitting cut short */
+	.priorities = {     /* Quick ones first, they'd rather not wait */
+		[OP_COPY] = 0,
+		[OP_MOVE] = 1,
+		[OP_LINK] = 2,
+		[OP_DELETE] = 1,
+		[OP_CHMOD] = 2,
+		[OP_SYNC] = 0,
+		[OP_PURGE] = -1,    /* Nobody's waiting for it */
+		[OP_UNDO] = 0,
+	},
+};
 
 static Assoc associations[] = {
 	{ ".pdf",   "zathura"},
@@ -27,17 +66,20 @@ static Key c_multi[] = {
 	{ 'd',          quick_cd,           {0}},
 	{ 'w',          rename_cur,         {0}},
 	{ 'm',          chmod_cur,          {0}},
+	{ 'o',          chown_cur,          {0}},
 	{ '\0',         NULL,               {0}},
 };
 
 static Key d_multi[] = {
 	{ 'd',          yank_cur,           {.i = 0}},
+	{ 'a',          yank_add,           {.i = 0}},
 	{ 'D',          delete_cur,         {.i = 0}},
 	{ '\0',         NULL,               {0}},
 };
 
 static Key g_multi[] = {
 	{ 'g',          abs_highlight,      {.i = 0}},
+	{ 't',          goto_trash,         {0}},
 	{ '\0',         NULL,               {0}},
 };
 
@@ -50,16 +92,36 @@ static Key i_multi[] = {
 static Key p_multi[] = {
 	{ 'p',          paste_cur,          {0}},
 	{ 'l',          link_cur,           {0}},
+	{ 's',          sync_cur,           {0}},
 	{ '\0',         NULL,               {0}},
 };
 
 static Key u_multi[] = {
 	{ 'v',          clear_sel,          {0}},
+	{ 'r',          restore_cur,        {0}},
+	{ 'u',          undo_cur,           {0}},
 	{ '\0',         NULL,               {0}},
 };
 
 static Key y_multi[] = {
 	{ 'y',          yank_cur,           {.i = 1}},
+	{ 'a',          yank_add,           {.i = 1}},
+	{ '\0',         NULL,               {0}},
+};
+
+static Key jobs_keys[] = {
+	{ 'j',          job_highlight,      {.i = +1}},
+	{ 'k',          job_highlight,      {.i = -1}},
+	{ KEY_DOWN,     job_highlight,      {.i = +1}},
+	{ KEY_UP,       job_highlight,      {.i = -1}},
+	{ 'p',          job_pause_cur,      {0}},
+	{ 'x',          job_cancel_cur,     {0}},
+	{ '+',          job_prioritize_cur, {.i = +1}},
+	{ '-',          job_prioritize_cur, {.i = -1}},
+	{ 'l',          job_limit_cur,      {.i = 0}},
+	{ 'L',          job_limit_cur,      {.i = 1}},
+	{ 'q',          jobs_close,         {0}},
+	{ 'J',          jobs_close,         {0}},
 	{ '\0',         NULL,               {0}},
 };
 
@@ -93,6 +155,7 @@ static Key keys[] = {
 	{ 'H',          toggle_hidden,      {0}},
 	{ 'u',          chain,              {.v = u_multi}},
 	{ 'i',          chain,              {.v = i_multi}},
+	{ 'J',          jobs_view,          {.v = jobs_keys}},
 /*	{ '!',          shell_exec,         {0}}, */
 	{ '\0',         NULL,               {0}},
 };
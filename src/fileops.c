@@ -1,118 +1,555 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/ioprio.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include "fileops.h"
+#include "hash.h"
+#include "journal.h"
 #include "sheriff.h"
+#include "uring.h"
 #include "utils.h"
+#include "verify.h"
+#include "walk.h"
 
-static int s_chmod_file(char *name, mode_t mode);
-static int s_copy_file(char *src, char *dest);
-static int s_delete_file(char *name);
+#define URING_BATCH 64              /* Files copied in a single batch */
+#define URING_BUFSIZE (64 * 1024)   /* Per-file bounce buffer size */
+#define URING_MAXSIZE (1024 * 1024) /* Bigger files are sendfile()d instead */
+#define BULK_CHUNK (8 * 1024 * 1024)    /* Bulk copies drop the cache this often */
+#define COPY_CHUNK (8 * 1024 * 1024)    /* Copies check if they should stop this often */
+#define THROTTLE_NAP 0.1    /* Longest throttled sleep between job checks, in s */
+#define BULK_WRITEBACK (SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | \
+                        SYNC_FILE_RANGE_WAIT_AFTER)
 
-static Progress m_progress;
+/* Stages a file goes through while being copied through io_uring. The stage
+ * is encoded in the low bits of the user_data of each sqe */
+enum uring_stages {
+	STAGE_OPEN_IN,
+	STAGE_STATX,
+	STAGE_OPEN_OUT,
+	STAGE_READ,
+	STAGE_WRITE,
+	STAGE_FSYNC,
+	STAGE_CLOSE
+};
 
-/* Accessory function to get the m_progress static global outside of here */
-Progress *
-fileop_progress()
+#define URING_TAG(idx, stage) (((unsigned long)(idx) << 3) | (stage))
+
+#define LINKMAP_HASH(dev, ino) (((size_t)(ino) * 2654435761u) ^ (size_t)(dev))
+
+/* A file with less blocks allocated than its size needs has holes in it */
+#define IS_SPARSE(blocks, size) ((off_t)(blocks) * 512 < (off_t)(size))
+
+/* Where the files with more than one link have been copied to, so that their
+ * other links can be recreated with link() instead of being copied again */
+struct link_slot {
+	dev_t dev;
+	ino_t ino;
+	char *path;                 /* NULL for empty slots */
+};
+
+typedef struct {
+	struct link_slot *slots;
+	size_t size, count;
+} Linkmap;
+
+struct uring_copy {
+	char src[NAME_MAX+1], dest[NAME_MAX+1];
+	char path[PATH_MAX];        /* Full path of the destination */
+	char *srcpath;              /* Full path of the source, if verifying */
+	const char *link;           /* Existing link to the source, if any */
+	int dir;                    /* Index of the directory fds in the batch */
+	int in_fd, out_fd;
+	struct statx stx;
+	off_t off;                  /* How far into the file we are */
+	ssize_t len;                /* Bytes sitting in the bounce buffer */
+	int status;
+};
+
+/* A batch of regular files waiting to be copied through a single ring. The
+ * files are opened relative to their source and destination directories, and
+ * the batch holds its own copy of those directory fds, since the walker might
+ * close the originals before the batch gets flushed */
+typedef struct {
+	Uring ring;
+	struct uring_copy req[URING_BATCH];
+	int dirs[URING_BATCH][2];
+	int ndirs;
+	int last_in, last_out;      /* Walker fds the last dirs entry came from */
+	Linkmap *links;
+	Verifier *verify;
+	Progress *pr;
+	char *buf;
+	int count;
+	int move;                   /* Every copy is queued, links too */
+} Copybatch;
+
+/* Timestamps of a copied directory, set once nothing else will be created in
+ * it anymore. Moves remove the source then, if nothing was left in it */
+struct dir_times {
+	struct dir_times *next;
+	struct timespec times[2];
+	char *src;                  /* Source directory, if moving */
+	char path[];
+};
+
+/* How copy_tree() goes about it, a bitmask */
+enum copy_flags {
+	COPY_SYNC = 1,              /* Skip files that are already up to date */
+	COPY_MOVE = 2               /* Remove the sources as they're copied */
+};
+
+/* What a copy needs to know on top of what the walker tells it */
+struct copy_ctx {
+	Copybatch *batch;
+	Linkmap *links;
+	Verifier *verify;
+	Progress *pr;
+	struct dir_times *dirs;     /* Directories whose timestamps are pending */
+	int sync;                   /* Skip files that are already up to date */
+	int move;                   /* Queue every node for its source to go */
+	int destfd;                 /* Parent directory of the destination root */
+	const char *destname;       /* Destination root, can differ from the src */
+	const char *dest;           /* Full path of the destination root */
+	size_t srclen;              /* Length of the source root path */
+};
+
+static int        batch_add(Copybatch *batch, int in_dirfd, const char *src,
+                            int out_dirfd, const char *dest,
+                            const char *path, char *srcpath);
+static int        batch_flush(Copybatch *batch);
+static void       batch_free(Copybatch *batch);
+static Copybatch* batch_new();
+static int        batch_reap(Copybatch *batch, int count);
+static double     bucket_take(Bucket *b, double amount,
+                              const struct timespec *now);
+static int        chmod_node(Walk *w, int event, int dirfd, const char *name,
+                             const struct stat *st);
+static int        copy_bulk(int in_fd, int out_fd, off_t size, Progress *pr);
+static int        copy_fd(int in_fd, int out_fd, off_t size, Progress *pr);
+static int        copy_holes(int in_fd, int out_fd, off_t size, Progress *pr);
+static int        copy_node(Walk *w, int event, int dirfd, const char *name,
+                            const struct stat *st);
+static int        copy_node_file(int in_dirfd, const char *src, int out_dirfd,
+                                 const char *dest, const struct stat *st,
+                                 struct copy_ctx *cp, const char *path);
+static int        copy_tree(char *src, char *dest, int flags, Progress *pr);
+static int        count_node(Walk *w, int event, int dirfd, const char *name,
+                             const struct stat *st);
+static int        delete_node(Walk *w, int event, int dirfd, const char *name,
+                              const struct stat *st);
+static int        file_digest(int dirfd, const char *name, uint64_t *digest);
+static void       linkmap_free(Linkmap *map);
+static const char* linkmap_get(const Linkmap *map, dev_t dev, ino_t ino);
+static void       linkmap_put(Linkmap *map, dev_t dev, ino_t ino,
+                              const char *path);
+static void       parent_changed(const char *path);
+static int        relink(const char *target, int dirfd, const char *name);
+static int        s_chmod_file(char *name, const Perms *perms, Progress *pr);
+static int        s_copy_file(char *src, char *dest, struct copy_ctx *cp);
+static int        s_delete_file(char *name, Progress *pr);
+static int        size_node(Walk *w, int event, int dirfd, const char *name,
+                            const struct stat *st);
+static int        sync_parent(const char *path);
+static int        up_to_date(int in_dirfd, const char *src, int out_dirfd,
+                             const char *dest, const struct stat *st);
+
+static Fileopts m_opts;
+static int m_uring_ok;              /* Can we copy through io_uring? */
+static Bucket m_bps, m_ops;         /* Limits on all the jobs together */
+static pthread_mutex_t m_throttle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Accessory function to get the options fileops_init() was given */
+const Fileopts *
+fileop_opts()
+{
+	return &m_opts;
+}
+
+void
+fileops_init(const Fileopts *opts)
+{
+	const unsigned char uring_ops[] = {
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE,
+		IORING_OP_FSYNC, IORING_OP_CLOSE
+	};
+
+	m_opts = *opts;
+	m_uring_ok = uring_probe(uring_ops, sizeof(uring_ops));
+	throttle_set(m_opts.max_bps, m_opts.max_ops);
+}
+
+/* Lower the CPU and I/O priority of the calling thread as the options say, so
+ * that the UI thread doesn't get stuck behind it when it lists directories or
+ * previews files. Meant for the threads carrying out jobs: both priorities are
+ * per thread, and the threads they start (walkers, verifiers) inherit them */
+void
+fileops_worker_init()
+{
+	pid_t tid;
+	int prio;
+
+	tid = syscall(SYS_gettid);
+	if (m_opts.nice > 0) {
+		errno = 0;
+		prio = getpriority(PRIO_PROCESS, tid);
+		if (!errno) {
+			setpriority(PRIO_PROCESS, tid, prio + m_opts.nice);
+		}
+	}
+	if (m_opts.ioclass != IOCLASS_NONE) {
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+		        IOPRIO_PRIO_VALUE(m_opts.ioclass, m_opts.iolevel));
+	}
+}
+
+/* Account for found more objects to work on and done more objects being done,
+ * fname being the last of them, and ask for the UI to show it. Meant to be
+ * called every few objects, not for every single one of them */
+void
+progress_add(Progress *pr, unsigned found, unsigned done, const char *fname)
+{
+	__atomic_fetch_add(&pr->obj_count, found, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&pr->obj_done, done, __ATOMIC_RELAXED);
+	if (fname) {
+		progress_name(pr, fname);
+	}
+
+	queue_master_update(UPDATE_STATUS, NULL);
+}
+
+/* Pause here if the operation has been paused, until it's resumed. Returns
+ * ECANCELED if it's been cancelled, and should stop as soon as possible */
+int
+progress_check(Progress *pr)
+{
+	int control;
+
+	if (!pr || __atomic_load_n(&pr->control, __ATOMIC_ACQUIRE) == PROGRESS_RUN) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pr->mutex);
+	while (pr->control == PROGRESS_PAUSE) {
+		pthread_cond_wait(&pr->cond, &pr->mutex);
+	}
+	control = pr->control;
+	pthread_mutex_unlock(&pr->mutex);
+
+	return control == PROGRESS_CANCEL ? ECANCELED : 0;
+}
+
+/* Ask the operations reporting to pr to pause, resume or give up */
+void
+progress_control(Progress *pr, int control)
+{
+	pthread_mutex_lock(&pr->mutex);
+	__atomic_store_n(&pr->control, control, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pr->cond);
+	pthread_mutex_unlock(&pr->mutex);
+}
+
+void
+progress_deinit(Progress *pr)
+{
+	pthread_cond_destroy(&pr->cond);
+	pthread_mutex_destroy(&pr->mutex);
+}
+
+/* Report why an operation failed. The message is shown by the main thread */
+void
+progress_error(Progress *pr, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&pr->mutex);
+	va_start(ap, fmt);
+	vsnprintf(pr->error, sizeof(pr->error), fmt, ap);
+	va_end(ap);
+	pthread_mutex_unlock(&pr->mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+}
+
+/* Set up a Progress struct for a new job */
+void
+progress_init(Progress *pr)
 {
-	return &m_progress;
+	memset(pr, '\0', sizeof(*pr));
+	pr->control = PROGRESS_RUN;
+	pr->bps.rate = m_opts.job_bps;
+	pr->ops.rate = m_opts.job_ops;
+	pthread_mutex_init(&pr->mutex, NULL);
+	pthread_cond_init(&pr->cond, NULL);
 }
 
+/* Limit a job to bps bytes and ops objects per second, 0 meaning no limit */
 void
-fileops_deinit()
+progress_limit(Progress *pr, unsigned long bps, unsigned long ops)
 {
-	pthread_mutex_destroy(&m_progress.mutex);
+	pthread_mutex_lock(&pr->mutex);
+	__atomic_store_n(&pr->bps.rate, bps, __ATOMIC_RELAXED);
+	__atomic_store_n(&pr->ops.rate, ops, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&pr->mutex);
 }
 
+/* Publish the name of the file being worked on, NULL if none. The name is
+ * copied, so it can go away as soon as this returns. If another thread is
+ * publishing a name of its own for the same job, this one is dropped: either
+ * of them will do */
 void
-fileops_init()
+progress_name(Progress *pr, const char *fname)
 {
-	pthread_mutex_init(&m_progress.mutex, NULL);
-	m_progress.obj_count = 0;
-	m_progress.obj_done = 0;
+	unsigned seq;
+	size_t i;
+
+	seq = __atomic_load_n(&pr->seq, __ATOMIC_RELAXED);
+	if ((seq & 1) || !__atomic_compare_exchange_n(&pr->seq, &seq, seq + 1, 0,
+	                                              __ATOMIC_ACQUIRE,
+	                                              __ATOMIC_RELAXED)) {
+		return;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i=0; fname && fname[i] && i < sizeof(pr->fname) - 1; i++) {
+		__atomic_store_n(pr->fname + i, fname[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(pr->fname + i, '\0', __ATOMIC_RELAXED);
+
+	__atomic_store_n(&pr->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
+/* Take a snapshot of how a job is doing. The counters might be a little out
+ * of step with each other, the file name is always a whole one */
+void
+progress_read(Progress *pr, Progstat *st)
+{
+	unsigned seq;
+	size_t i;
+	int tries;
+
+	st->obj_count = __atomic_load_n(&pr->obj_count, __ATOMIC_RELAXED);
+	st->obj_done = __atomic_load_n(&pr->obj_done, __ATOMIC_RELAXED);
+	st->bytes = __atomic_load_n(&pr->bytes, __ATOMIC_RELAXED);
+	st->holes = __atomic_load_n(&pr->holes, __ATOMIC_RELAXED);
+	st->skipped_bytes = __atomic_load_n(&pr->skipped_bytes, __ATOMIC_RELAXED);
+	st->mismatches = __atomic_load_n(&pr->mismatches, __ATOMIC_RELAXED);
+	st->skipped = __atomic_load_n(&pr->skipped, __ATOMIC_RELAXED);
+	st->control = __atomic_load_n(&pr->control, __ATOMIC_ACQUIRE);
+
+	/* Names are short and rarely rewritten, a few tries are plenty. If the
+	 * worker keeps getting in the way, there's just no name this time */
+	for (tries = 0; tries < 8; tries++) {
+		if ((seq = __atomic_load_n(&pr->seq, __ATOMIC_ACQUIRE)) & 1) {
+			continue;
+		}
+		for (i=0; i < sizeof(st->fname) - 1 &&
+		     (st->fname[i] = __atomic_load_n(pr->fname + i, __ATOMIC_RELAXED));
+		     i++)
+			;
+		st->fname[i] = '\0';
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&pr->seq, __ATOMIC_RELAXED) == seq) {
+			return;
+		}
+	}
+	*st->fname = '\0';
+}
 
-/* Chmod a file, and if it's a directory, chmod all of its contents as well */
+/* Account for bytes more bytes and ops more objects having been worked on,
+ * and wait for as long as it takes to bring the job and the jobs as a whole
+ * back under their limits. Like progress_check(), returns ECANCELED if the job
+ * has been cancelled, and stops waiting if it happens in the meantime */
 int
-chmod_file(char *name, mode_t mode)
+progress_throttle(Progress *pr, unsigned long bytes, unsigned ops)
 {
-	s_chmod_file(name, mode);
-	queue_master_update();
+	struct timespec now, nap;
+	double wait, w;
+	int retval;
+
+	if (!pr || (retval = progress_check(pr))) {
+		return pr ? retval : 0;
+	}
+	if ((!bytes && !ops) ||
+	    (!__atomic_load_n(&pr->bps.rate, __ATOMIC_RELAXED) &&
+	     !__atomic_load_n(&pr->ops.rate, __ATOMIC_RELAXED) &&
+	     !__atomic_load_n(&m_bps.rate, __ATOMIC_RELAXED) &&
+	     !__atomic_load_n(&m_ops.rate, __ATOMIC_RELAXED))) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&pr->mutex);
+	wait = bucket_take(&pr->bps, bytes, &now);
+	if ((w = bucket_take(&pr->ops, ops, &now)) > wait) {
+		wait = w;
+	}
+	pthread_mutex_unlock(&pr->mutex);
+
+	/* Both kinds of bucket fill up at the same time, the longest wait pays
+	 * all the debts back */
+	pthread_mutex_lock(&m_throttle_mutex);
+	if ((w = bucket_take(&m_bps, bytes, &now)) > wait) {
+		wait = w;
+	}
+	if ((w = bucket_take(&m_ops, ops, &now)) > wait) {
+		wait = w;
+	}
+	pthread_mutex_unlock(&m_throttle_mutex);
+
+	/* Nap in short slices, so that pausing or cancelling isn't held up */
+	for (; wait > 0; wait -= w) {
+		w = (wait > THROTTLE_NAP ? THROTTLE_NAP : wait);
+		nap.tv_sec = w;
+		nap.tv_nsec = (w - nap.tv_sec) * 1e9;
+		nanosleep(&nap, NULL);
+		if ((retval = progress_check(pr))) {
+			return retval;
+		}
+	}
 
 	return 0;
 }
 
-/* Copy a file, and if it's a directory, all of its contents as well */
+/* Check whether need bytes fit in the filesystem path is on. Returns 0 if they
+ * do, ENOSPC (after reporting how much space is missing) if they don't */
 int
-copy_file(char *src, char *dest)
+space_check(const char *path, off_t need, Progress *pr)
 {
-	int copy_status;
+	struct statvfs vfs;
+	char hneed[16], havail[16];
+	off_t avail;
 
-	copy_status = s_copy_file(src, dest);
+	if (statvfs(path, &vfs) < 0) {
+		return 0;   /* Can't tell, let the copy find out */
+	}
 
-	switch (copy_status) {
-	case ENOMEM:    /* 4 intentional fallthroughs */
-	case EINVAL:
-	case EOVERFLOW:
-	case EIO:
-		delete_file(dest);
-		break;
-	default:
-		break;
+	avail = (off_t)vfs.f_bavail * vfs.f_frsize;
+	if (need <= avail) {
+		return 0;
 	}
 
-	queue_master_update();
+	tohuman(need, hneed);
+	tohuman(avail, havail);
+	progress_error(pr, "Not enough space in %s: %s needed, %s free",
+	               path, hneed, havail);
+	return ENOSPC;
+}
 
-	return copy_status;
+/* Get the limits on all the jobs together */
+void
+throttle_get(unsigned long *bps, unsigned long *ops)
+{
+	*bps = __atomic_load_n(&m_bps.rate, __ATOMIC_RELAXED);
+	*ops = __atomic_load_n(&m_ops.rate, __ATOMIC_RELAXED);
+}
+
+/* Limit all the jobs together to bps bytes and ops objects per second, 0
+ * meaning no limit */
+void
+throttle_set(unsigned long bps, unsigned long ops)
+{
+	pthread_mutex_lock(&m_throttle_mutex);
+	__atomic_store_n(&m_bps.rate, bps, __ATOMIC_RELAXED);
+	__atomic_store_n(&m_ops.rate, ops, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&m_throttle_mutex);
+}
+
+/* Space taken up by a tree, holes excluded. Directories aren't accounted for */
+off_t
+tree_size(char *path)
+{
+	off_t size;
+
+	size = 0;
+	walk_tree_parallel(path, size_node, &size, WALK_STAT, NULL, m_opts.threads);
+
+	return size;
+}
+
+/* Chmod and chown a file, and if it's a directory, all of its contents as well */
+int
+chmod_file(char *name, const Perms *perms, Progress *pr)
+{
+	int chmod_status;
+
+	chmod_status = s_chmod_file(name, perms, pr);
+	parent_changed(name);
+
+	return chmod_status == ECANCELED ? chmod_status : 0;
+}
+
+/* Copy a file, and if it's a directory, all of its contents as well */
+int
+copy_file(char *src, char *dest, Progress *pr)
+{
+	return copy_tree(src, dest, 0, pr);
 }
 
 /* Delete a file, and if it's a directory, all of its contents as well */
 int
-delete_file(char *name)
+delete_file(char *name, Progress *pr)
 {
 	int delete_status;
 
-	delete_status = s_delete_file(name);
-	queue_master_update();
+	delete_status = s_delete_file(name, pr);
+	parent_changed(name);
 
 	return delete_status;
 }
 
 /* Symlink a file, and only that file, even if it is a directory */
 int
-link_file(char *src, char *dest)
+link_file(char *src, char *dest, Progress *pr)
 {
 	if (symlink(src, dest) < 0) {
 		return errno;
 	}
+	progress_add(pr, 1, 1, NULL);
+	parent_changed(dest);
+
+	if (m_opts.durability == DURABLE_STRICT) {
+		return sync_parent(dest);
+	}
 	return 0;
 }
 
 /* Move something by trying to use rename() since it's faster and atomic by
- * definition. If this does not work, resort to copying src to dest and deleting
- * the source. If anything fails during the copy, bail out, since we can't be
- * sure the files have made it safely to their new destination */
+ * definition. If this does not work, resort to copying src to dest, removing
+ * every source file as soon as its copy checks out, so that a big move doesn't
+ * need room for all of it twice. What fails to copy stays where it was.
+ * A move resumed from the job's journal syncs, to skip what's been moved
+ * already and remove the sources that were left behind */
 int
-move_file(char *src, char *dest)
+move_file(char *src, char *dest, Progress *pr)
 {
 	int retval;
 
 	retval = 0;
-	if (rename(src, dest)) {    /* Try to rename atomically */
+	if (!rename(src, dest)) {   /* Try to rename atomically */
+		progress_add(pr, 1, 1, NULL);
+		parent_changed(src);
+		parent_changed(dest);
+		if (m_opts.durability == DURABLE_STRICT &&
+		    (retval = sync_parent(dest)) == 0) {
+			retval = sync_parent(src);
+		}
+	} else {
 		if (errno == EXDEV) {   /* We're moving across filesystems */
-			if ((retval = copy_file(src, dest)) < 0) {
-				return retval;
-			}
-			if ((retval = delete_file(src)) < 0) {
-				return retval;
-			}
+			return copy_tree(src, dest, COPY_MOVE |
+			                 (journal_resumed(pr->journal) ? COPY_SYNC : 0), pr);
 		} else {
 			return errno;
 		}
@@ -120,6 +557,29 @@ move_file(char *src, char *dest)
 	return retval;
 }
 
+/* Copy src to dest like copy_file() does, but leave alone the files that are
+ * already up to date in dest */
+int
+sync_file(char *src, char *dest, Progress *pr)
+{
+	return copy_tree(src, dest, COPY_SYNC, pr);
+}
+
+/* Flush everything written to the filesystem path lives in to disk */
+int
+file_syncfs(const char *path)
+{
+	int fd, retval;
+
+	if ((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0) {
+		return errno;
+	}
+	retval = (syncfs(fd) < 0 ? errno : 0);
+	close(fd);
+
+	return retval;
+}
+
 /* Create a directory in the specified path, default mode is 0755 TODO: possibly
  * allow changing that mode to something else */
 int
@@ -151,192 +611,1311 @@ file_touch(const char *name, const char *path)
 }
 
 /* Static functions {{{ */
-/* Enumerate a directory contents to guesstimate how long an operation will
- * approximately take. Note than a finer-grained estimate would slow down the
- * operation significatly, because it wouldn't be carried out in a single
- * sendfile() call like it is now */
-unsigned
-enumerate_dir(char *path)
+/* Queue a regular file for copying, flushing the batch first if it's full.
+ * Returns -1 if the batch can't take a copy of the directory fds, leaving the
+ * file, and srcpath, to the caller */
+int
+batch_add(Copybatch *batch, int in_dirfd, const char *src, int out_dirfd,
+          const char *dest, const char *path, char *srcpath)
 {
-	DIR *dp;
-	struct dirent *ep;
-	struct stat st;
-	char *subpath;
-	unsigned count;
+	struct uring_copy *req;
+	int fds[2], newdir, retval;
 
-	count = 1;
-	if ((dp = opendir(path))) {
-		while ((ep = readdir(dp))) {
-			if (!is_dot_or_dotdot(ep->d_name)) {
-				count++;
-				subpath = join_path(path, ep->d_name);
-				lstat(subpath, &st);
+	/* Consecutive files usually come from the same directory, so only take
+	 * a copy of the directory fds when they change, or the batch is flushed.
+	 * They're taken first, so that a failure loses nothing */
+	newdir = (batch->count >= URING_BATCH || in_dirfd != batch->last_in ||
+	          out_dirfd != batch->last_out);
+	if (newdir && ((fds[0] = dup(in_dirfd)) < 0 ||
+	               (fds[1] = dup(out_dirfd)) < 0)) {
+		if (fds[0] >= 0) {
+			close(fds[0]);
+		}
+		return -1;
+	}
 
-				if (S_ISDIR(st.st_mode)) {
-					count += enumerate_dir(subpath);
-				}
+	retval = 0;
+	if (batch->count >= URING_BATCH) {
+		retval = batch_flush(batch);
+	}
 
-				free(subpath);
-			}
-		}
-		closedir(dp);
+	if (newdir) {
+		batch->dirs[batch->ndirs][0] = fds[0];
+		batch->dirs[batch->ndirs][1] = fds[1];
+		batch->last_in = in_dirfd;
+		batch->last_out = out_dirfd;
+		batch->ndirs++;
 	}
 
-	return count;
+	req = batch->req + batch->count++;
+	strcpy(req->src, src);
+	strcpy(req->dest, dest);
+	strcpy(req->path, path);
+	req->srcpath = srcpath;
+	req->link = NULL;
+	req->dir = batch->ndirs - 1;
+	req->in_fd = -1;
+	req->out_fd = -1;
+	req->off = 0;
+	req->len = 0;
+	req->status = 0;
+
+	return retval;
 }
 
-/* Recursive chmodding of a directory and its children. Possible TODO: add an
- * option to just chmod the top level file */
+/* Copy all the files queued in a batch. Every stage (opening the sources,
+ * creating the destinations, moving data, closing) is submitted for all the
+ * files at once, so that the syscall count doesn't depend on the number of
+ * files. Files too big to be worth bouncing through userspace are sendfile()d
+ * instead */
 int
-s_chmod_file(char *name, mode_t mode)
+batch_flush(Copybatch *batch)
 {
-	char *subpath;
-	struct stat st;
-	DIR *dp;
-	struct dirent *ep;
+	struct io_uring_sqe *sqe;
+	struct uring_copy *req;
+	struct timespec times[2];
+	unsigned long bytes, bounced;
+	dev_t dev;
+	int i, n, err, retval, ring_err;
+
+	if (batch->count == 0) {
+		return 0;
+	}
+
+	/* Open and statx() all the sources */
+	for (i=0; i<batch->count; i++) {
+		req = batch->req + i;
+
+		sqe = uring_get_sqe(&batch->ring);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = batch->dirs[req->dir][0];
+		sqe->addr = (unsigned long)req->src;
+		sqe->open_flags = O_RDONLY|O_NOFOLLOW|O_CLOEXEC;
+		sqe->user_data = URING_TAG(i, STAGE_OPEN_IN);
+
+		sqe = uring_get_sqe(&batch->ring);
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = batch->dirs[req->dir][0];
+		sqe->addr = (unsigned long)req->src;
+		sqe->len = STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE |
+		           STATX_BLOCKS | STATX_ATIME | STATX_MTIME;
+		sqe->off = (unsigned long)&req->stx;
+		sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		sqe->user_data = URING_TAG(i, STAGE_STATX);
+	}
+	ring_err = batch_reap(batch, 2 * batch->count);
+
+	/* Files we've already copied under another name only need a link. The
+	 * link is made once the first copy has been created */
+	for (i=0; i<batch->count && !ring_err; i++) {
+		req = batch->req + i;
+		if (req->status || req->stx.stx_nlink < 2) {
+			continue;
+		}
+		dev = makedev(req->stx.stx_dev_major, req->stx.stx_dev_minor);
+		if ((req->link = linkmap_get(batch->links, dev, req->stx.stx_ino))) {
+			req->off = req->stx.stx_size;
+		} else {
+			linkmap_put(batch->links, dev, req->stx.stx_ino, req->path);
+		}
+	}
+
+	/* Create the destinations, with the same mode as the sources */
+	for (i=0, n=0; i<batch->count && !ring_err; i++) {
+		req = batch->req + i;
+		if (!req->status && !req->link) {
+			sqe = uring_get_sqe(&batch->ring);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = batch->dirs[req->dir][1];
+			sqe->addr = (unsigned long)req->dest;
+			sqe->len = req->stx.stx_mode & 07777;
+			sqe->open_flags = O_WRONLY|O_CREAT|O_CLOEXEC;
+			sqe->user_data = URING_TAG(i, STAGE_OPEN_OUT);
+			n++;
+		}
+	}
+	if (!ring_err) {
+		ring_err = batch_reap(batch, n);
+	}
+
+	for (i=0; i<batch->count && !ring_err; i++) {
+		req = batch->req + i;
+		if (!req->status && req->link) {
+			req->status = relink(req->link, batch->dirs[req->dir][1], req->dest);
+		}
+	}
+
+	/* Big files are better off going through sendfile(), and sparse ones
+	 * need their holes looked for */
+	for (i=0; i<batch->count && !ring_err; i++) {
+		req = batch->req + i;
+		if (req->status || req->link) {
+			continue;
+		}
+		if (IS_SPARSE(req->stx.stx_blocks, req->stx.stx_size)) {
+			req->status = copy_holes(req->in_fd, req->out_fd, req->stx.stx_size,
+			                         batch->pr);
+			req->off = req->stx.stx_size;
+		} else if (req->stx.stx_size > URING_MAXSIZE) {
+			req->status = copy_fd(req->in_fd, req->out_fd, req->stx.stx_size,
+			                      batch->pr);
+			req->off = req->stx.stx_size;
+		}
+	}
+
+	/* Bounce the small ones through the per-file buffers, a read and a write
+	 * round for everyone at a time */
+	bounced = 0;
+	do {
+		for (i=0, n=0; i<batch->count && !ring_err; i++) {
+			req = batch->req + i;
+			req->len = 0;
+			if (!req->status && req->off < req->stx.stx_size) {
+				sqe = uring_get_sqe(&batch->ring);
+				sqe->opcode = IORING_OP_READ;
+				sqe->fd = req->in_fd;
+				sqe->addr = (unsigned long)(batch->buf + i * URING_BUFSIZE);
+				sqe->len = req->stx.stx_size - req->off;
+				if (sqe->len > URING_BUFSIZE) {
+					sqe->len = URING_BUFSIZE;
+				}
+				sqe->off = req->off;
+				sqe->user_data = URING_TAG(i, STAGE_READ);
+				n++;
+			}
+		}
+		if (!ring_err) {
+			ring_err = batch_reap(batch, n);
+		}
 
-	lstat(name, &st);
-	chmod(name, mode);
+		for (i=0, n=0; i<batch->count && !ring_err; i++) {
+			req = batch->req + i;
+			if (!req->status && req->len > 0) {
+				sqe = uring_get_sqe(&batch->ring);
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->fd = req->out_fd;
+				sqe->addr = (unsigned long)(batch->buf + i * URING_BUFSIZE);
+				sqe->len = req->len;
+				sqe->off = req->off;
+				sqe->user_data = URING_TAG(i, STAGE_WRITE);
+				bounced += req->len;
+				n++;
+			} else if (!req->status && req->off < req->stx.stx_size) {
+				req->stx.stx_size = req->off;   /* File shrunk under us */
+			}
+		}
+		if (!ring_err) {
+			ring_err = batch_reap(batch, n);
+		}
+	} while (n > 0 && !ring_err);
 
-	pthread_mutex_lock(&m_progress.mutex);
-	m_progress.obj_done++;
-	pthread_mutex_unlock(&m_progress.mutex);
+	/* Same as copy_node_file(): cut what was there before, and keep the
+	 * timestamps. The files that didn't bounce were cut by copy_fd() */
+	for (i=0; i<batch->count && !ring_err; i++) {
+		req = batch->req + i;
+		if (req->status || req->out_fd < 0) {
+			continue;
+		}
+		if (!IS_SPARSE(req->stx.stx_blocks, req->stx.stx_size) &&
+		    req->stx.stx_size <= URING_MAXSIZE &&
+		    ftruncate(req->out_fd, req->off) < 0) {
+			req->status = errno;
+			continue;
+		}
+		times[0].tv_sec = req->stx.stx_atime.tv_sec;
+		times[0].tv_nsec = req->stx.stx_atime.tv_nsec;
+		times[1].tv_sec = req->stx.stx_mtime.tv_sec;
+		times[1].tv_nsec = req->stx.stx_mtime.tv_nsec;
+		futimens(req->out_fd, times);
+	}
 
-	if (S_ISDIR(st.st_mode) && (dp = opendir(name))) {
-		while ((ep = readdir(dp))) {                /* Self-call on subnodes */
-			if (!is_dot_or_dotdot(ep->d_name)) {    /* Except for . and .. */
-				subpath = join_path(name, ep->d_name);
-				s_chmod_file(subpath, mode);
-				free(subpath);
+	/* Make sure the data is on disk before letting go of the files */
+	if (m_opts.durability == DURABLE_STRICT) {
+		for (i=0, n=0; i<batch->count && !ring_err; i++) {
+			req = batch->req + i;
+			if (!req->status && req->out_fd >= 0) {
+				sqe = uring_get_sqe(&batch->ring);
+				sqe->opcode = IORING_OP_FSYNC;
+				sqe->fd = req->out_fd;
+				sqe->user_data = URING_TAG(i, STAGE_FSYNC);
+				n++;
 			}
 		}
-		closedir(dp);   /* Don't forget to pick up the trash on your way out! */
+		if (!ring_err) {
+			ring_err = batch_reap(batch, n);
+		}
 	}
 
-	return 0;
+	/* Close everything we opened. If the ring broke down, do it by hand */
+	for (i=0, n=0; i<batch->count; i++) {
+		req = batch->req + i;
+		if (ring_err) {
+			req->status = ring_err;
+			if (req->in_fd >= 0) {
+				close(req->in_fd);
+			}
+			if (req->out_fd >= 0) {
+				close(req->out_fd);
+			}
+			continue;
+		}
+		if (req->in_fd >= 0) {
+			sqe = uring_get_sqe(&batch->ring);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = req->in_fd;
+			sqe->user_data = URING_TAG(i, STAGE_CLOSE);
+			n++;
+		}
+		if (req->out_fd >= 0) {
+			sqe = uring_get_sqe(&batch->ring);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = req->out_fd;
+			sqe->user_data = URING_TAG(i, STAGE_CLOSE);
+			n++;
+		}
+	}
+	if (!ring_err) {
+		batch_reap(batch, n);
+	}
+
+	/* Same cleanup policy as copy_node() */
+	retval = 0;
+	bytes = 0;
+	for (i=0; i<batch->count; i++) {
+		req = batch->req + i;
+		switch (req->status) {
+		case ENOMEM:    /* 4 intentional fallthroughs */
+		case EINVAL:
+		case EOVERFLOW:
+		case EIO:
+			unlinkat(batch->dirs[req->dir][1], req->dest, 0);
+			break;
+		default:
+			break;
+		}
+		if (req->status) {
+			retval = req->status;
+		} else if (!req->link) {
+			bytes += req->stx.stx_size;
+			if (batch->verify) {
+				verify_queue(batch->verify, req->srcpath, req->path,
+				             req->stx.stx_size);
+			}
+		} else if (batch->move) {
+			verify_queue(batch->verify, req->srcpath, req->path, 0);
+		}
+		free(req->srcpath);
+	}
+
+	__atomic_fetch_add(&batch->pr->bytes, bytes, __ATOMIC_RELAXED);
+
+	for (i=0; i<batch->ndirs; i++) {
+		/* And so are the directory entries pointing to them */
+		if (m_opts.durability == DURABLE_STRICT && fsync(batch->dirs[i][1]) < 0) {
+			retval = errno;
+		}
+		close(batch->dirs[i][0]);
+		close(batch->dirs[i][1]);
+	}
+
+	batch->count = 0;
+	batch->ndirs = 0;
+	batch->last_in = -1;
+	batch->last_out = -1;
+
+	/* The bounced files went through in one go, they're paid for afterwards.
+	 * The sendfile()d ones were as they went */
+	if ((err = progress_throttle(batch->pr, bounced, 0)) && !retval) {
+		retval = err;
+	}
+
+	return retval;
 }
 
-/* Recursive copying backend. Possible TODO: make this iterative */
-int
-s_copy_file(char *src, char *dest)
+/* Free a batch. Anything still queued in it is dropped, not copied */
+void
+batch_free(Copybatch *batch)
 {
-	char *subpath_src, *subpath_dest;
-	int in_fd, out_fd;
-	int retval;
-	DIR *dp;
-	struct stat st;
-	struct dirent *ep;
+	int i;
+
+	for (i=0; i<batch->count; i++) {
+		free(batch->req[i].srcpath);
+	}
+	for (i=0; i<batch->ndirs; i++) {
+		close(batch->dirs[i][0]);
+		close(batch->dirs[i][1]);
+	}
+	uring_deinit(&batch->ring);
+	free(batch->buf);
+	free(batch);
+}
 
-	pthread_mutex_lock(&m_progress.mutex);
-	m_progress.fname = dest;
-	pthread_mutex_unlock(&m_progress.mutex);
+/* Allocate a new batch, returns NULL if io_uring can't be used */
+Copybatch *
+batch_new()
+{
+	Copybatch *batch;
 
-	retval = -1;
-	if ((in_fd = open(src, O_RDONLY)) < 0) {
-		return retval;
+	if (!m_uring_ok) {
+		return NULL;
 	}
-	if (fstat(in_fd, &st)) {
-		return retval;
+
+	batch = safealloc(sizeof(*batch));
+	if (uring_init(&batch->ring, 2 * URING_BATCH)) {
+		free(batch);
+		return NULL;
 	}
+	batch->buf = safealloc(URING_BATCH * URING_BUFSIZE);
+	batch->count = 0;
+	batch->ndirs = 0;
+	batch->last_in = -1;
+	batch->last_out = -1;
 
-	if ((dp = fdopendir(in_fd))) {      /* Try to open in_fd as a directory */
-		mkdir(dest, st.st_mode);        /* """copy""" the directory */
-
-		/* Scan the directory, and self-call on each node contained inside */
-		while ((ep = readdir(dp))) {
-			if (!is_dot_or_dotdot(ep->d_name)) {    /* Skip . and .. */
-				subpath_src = join_path(src, ep->d_name);
-				subpath_dest = join_path(dest, ep->d_name);
-				retval = s_copy_file(subpath_src, subpath_dest);
-
-				pthread_mutex_lock(&m_progress.mutex);
-				m_progress.fname = dest;
-				pthread_mutex_unlock(&m_progress.mutex);
-
-				free(subpath_src);
-				free(subpath_dest);
-
-				/* Clean up the mess if the copy failed (read: delete the file
-				 * if something bad happened during the copy */
-				switch (retval) {
-				case ENOMEM:            /* 4 intentional fallthroughs */
-				case EINVAL:
-				case EOVERFLOW:
-				case EIO:
-					delete_file(subpath_dest);
-					break;
-				default:
-					break;
-				}
+	return batch;
+}
 
-			}
+/* Submit the pending sqes and wait for count completions, storing each result
+ * in the request it belongs to. Returns nonzero only if the ring itself failed */
+int
+batch_reap(Copybatch *batch, int count)
+{
+	struct io_uring_cqe cqe;
+	struct uring_copy *req;
+	int err;
+
+	if ((err = uring_submit(&batch->ring))) {
+		return err;
+	}
+
+	for (; count > 0; count--) {
+		if ((err = uring_wait_cqe(&batch->ring, &cqe))) {
+			return err;
 		}
-		closedir(dp);                   /* No need to close(in_fd) */
-	} else {
-		if (errno == ENOTDIR) {         /* Src is a file: fstat and copy it */
-			if ((out_fd = open(dest, O_WRONLY|O_CREAT, st.st_mode)) >= 0) {
-				if (sendfile(out_fd, in_fd, NULL, st.st_size) < 0) {
-					retval = errno;
-				} else {
-					retval = 0;
-				}
-				close(out_fd);
-			} else {
-				retval = errno;
+
+		req = batch->req + (cqe.user_data >> 3);
+		if (cqe.res < 0) {
+			if ((cqe.user_data & 7) != STAGE_CLOSE) {
+				req->status = -cqe.res;
 			}
+			continue;
+		}
+
+		switch (cqe.user_data & 7) {
+		case STAGE_OPEN_IN:
+			req->in_fd = cqe.res;
+			break;
+		case STAGE_OPEN_OUT:
+			req->out_fd = cqe.res;
+			break;
+		case STAGE_READ:
+			req->len = cqe.res;
+			break;
+		case STAGE_WRITE:
+			req->off += cqe.res;
+			break;
+		default:
+			break;
 		}
-		close(in_fd);
 	}
 
+	return 0;
+}
 
-	pthread_mutex_lock(&m_progress.mutex);
-	m_progress.obj_done++;
-	pthread_mutex_unlock(&m_progress.mutex);
+/* Take amount tokens out of a bucket, once it's been refilled with what it
+ * earned since the last time. Returns how long to wait, in seconds, before the
+ * bucket is out of debt. Must be called with the bucket locked */
+double
+bucket_take(Bucket *b, double amount, const struct timespec *now)
+{
+	if (!b->rate) {
+		b->tokens = 0;
+	} else if (!b->last.tv_sec && !b->last.tv_nsec) {
+		b->tokens = b->rate;
+	} else {
+		b->tokens += b->rate * ((now->tv_sec - b->last.tv_sec) +
+		                        (now->tv_nsec - b->last.tv_nsec) / 1e9);
+	}
+	b->last = *now;
 
-	queue_master_update();              /* Request an UI update */
+	/* No more than a second's worth of tokens can pile up */
+	if (b->tokens > b->rate) {
+		b->tokens = b->rate;
+	}
+	if (!b->rate) {
+		return 0;
+	}
 
-	return retval;
+	b->tokens -= amount;
+	return b->tokens < 0 ? -b->tokens / b->rate : 0;
 }
 
-/* Recursive deletion. Possible TODO: make this iterative */
+/* Chmod and chown a single node, unless it's right already: writing the same
+ * inode back is what makes big trees slow. Symlinks keep their mode, since
+ * chmod() would follow them outside of the tree. Directories get what they
+ * gain before their contents are visited, and lose the rest after, so that
+ * the walk can still get into them */
 int
-s_delete_file(char *name)
+chmod_node(Walk *w, int event, int dirfd, const char *name,
+           const struct stat *st)
 {
-	DIR *dp;
-	struct dirent *ep;
-	char *subpath;
-	struct stat st;
+	const Perms *perms;
+	mode_t mode, old;
+	uid_t uid;
+	gid_t gid;
 
-	lstat(name, &st);
+	perms = w->arg;
+	old = st->st_mode & 07777;
+	mode = perms_apply(perms, st->st_mode) & 07777;
 
-	pthread_mutex_lock(&m_progress.mutex);
-	m_progress.fname = name;
-	pthread_mutex_unlock(&m_progress.mutex);
+	if (event == WALK_DIR_POST) {
+		if (mode != (old | mode) && fchmodat(dirfd, name, mode, 0) < 0) {
+			return errno;
+		}
+		return 0;
+	}
 
-	/* Delete a directory's contents before attempting to delete the directory
-	 * itself to prevent an ENOTEMPTY */
-	if(S_ISDIR(st.st_mode) && (dp = opendir(name))) {
-		while ((ep = readdir(dp))) {
-			if (!is_dot_or_dotdot(ep->d_name)) {
-				subpath = join_path(name, ep->d_name);
-				s_delete_file(subpath);
-				free(subpath);
-			}
+	uid = (perms->uid == st->st_uid ? (uid_t)-1 : perms->uid);
+	gid = (perms->gid == st->st_gid ? (gid_t)-1 : perms->gid);
+	if (uid != (uid_t)-1 || gid != (gid_t)-1) {
+		if (fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+			return errno;
 		}
-		closedir(dp);
+		/* Which might have cleared the setuid and setgid bits */
+		old &= ~(S_ISUID | S_ISGID);
 	}
 
-	/* Delete the file/folder itself */
-	if (remove(name) < 0) {
+	if (S_ISLNK(st->st_mode)) {
+		return 0;
+	}
+	if (event == WALK_DIR_PRE) {
+		mode |= old;
+	}
+	if (mode != old && fchmodat(dirfd, name, mode, 0) < 0) {
 		return errno;
 	}
 
-	pthread_mutex_lock(&m_progress.mutex);
-	m_progress.obj_done++;
-	pthread_mutex_unlock(&m_progress.mutex);
+	return 0;
+}
 
-	queue_master_update();
+/* Copy a big file without leaving it in the page cache, where it would evict
+ * things more likely to be used again. The data goes through in chunks: once a
+ * chunk has been written back, both its source and destination pages are
+ * dropped. Writeback of a chunk is started right away, and only waited for
+ * after the next one has been sent, so that the disks are kept busy */
+int
+copy_bulk(int in_fd, int out_fd, off_t size, Progress *pr)
+{
+	off_t start, end, prev, off;
+	ssize_t sent;
+	int retval;
+
+	posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	for (start = 0, prev = -1; start < size; prev = start, start = end) {
+		if ((retval = progress_check(pr))) {
+			return retval;
+		}
+		end = (size - start > BULK_CHUNK ? start + BULK_CHUNK : size);
+		for (off = start; off < end; ) {
+			if ((sent = sendfile(out_fd, in_fd, &off, end - off)) < 0) {
+				return errno;
+			}
+			if (sent == 0) {    /* Source got truncated while we were copying */
+				end = size = off;
+			}
+		}
+		if ((retval = progress_throttle(pr, end - start, 0))) {
+			return retval;
+		}
+
+		/* Start writing this chunk back, and finish the previous one */
+		sync_file_range(out_fd, start, end - start, SYNC_FILE_RANGE_WRITE);
+		posix_fadvise(in_fd, start, end - start, POSIX_FADV_DONTNEED);
+		if (prev >= 0) {
+			sync_file_range(out_fd, prev, start - prev, BULK_WRITEBACK);
+			posix_fadvise(out_fd, prev, start - prev, POSIX_FADV_DONTNEED);
+		}
+	}
+
+	/* The last chunk is still on its way to the disk */
+	if (prev >= 0) {
+		sync_file_range(out_fd, prev, start - prev, BULK_WRITEBACK);
+		posix_fadvise(out_fd, prev, start - prev, POSIX_FADV_DONTNEED);
+	}
+
+	return 0;
+}
+
+/* Copy size bytes from in_fd to out_fd. sendfile() moves at most ~2GB per
+ * call, so loop until everything has made it through */
+int
+copy_fd(int in_fd, int out_fd, off_t size, Progress *pr)
+{
+	ssize_t sent;
+	off_t end;
+	int retval;
+
+	/* Have the filesystem allocate the whole file in one go rather than
+	 * piecemeal, and find out right away if it can't */
+	if (size > 0 && fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, size) < 0 &&
+	    errno == ENOSPC) {
+		return errno;
+	}
+
+	if (m_opts.bulk_size > 0 && size >= m_opts.bulk_size) {
+		retval = copy_bulk(in_fd, out_fd, size, pr);
+	} else {
+		for (retval = 0; size > 0; size -= sent) {
+			if ((retval = progress_check(pr))) {
+				return retval;
+			}
+			sent = sendfile(out_fd, in_fd, NULL,
+			                size > COPY_CHUNK ? COPY_CHUNK : size);
+			if (sent < 0) {
+				return errno;
+			}
+			if (sent == 0) {    /* Source got truncated while we were copying */
+				break;
+			}
+			if ((retval = progress_throttle(pr, sent, 0))) {
+				return retval;
+			}
+		}
+	}
+
+	/* Whatever was at the destination before might have been longer. It's
+	 * cut rather than truncated beforehand, which would wipe src out if it
+	 * happened to be the same file as dest */
+	if (!retval && ((end = lseek(out_fd, 0, SEEK_CUR)) < 0 ||
+	                ftruncate(out_fd, end) < 0)) {
+		retval = errno;
+	}
+
+	return retval;
+}
+
+/* Copy size bytes from in_fd to out_fd, skipping over the holes in in_fd and
+ * leaving them as holes in out_fd as well */
+int
+copy_holes(int in_fd, int out_fd, off_t size, Progress *pr)
+{
+	struct stat out_st;
+	off_t data, hole, skipped;
+	ssize_t sent;
+	int punch, retval;
+
+	/* Holes over an existing file have to be punched into its old data */
+	punch = (!fstat(out_fd, &out_st) && out_st.st_size > 0);
+
+	for (skipped = 0, hole = 0; hole < size; hole = data) {
+		if ((data = lseek(in_fd, hole, SEEK_DATA)) < 0) {
+			if (errno == EINVAL && hole == 0) { /* No SEEK_DATA support */
+				return copy_fd(in_fd, out_fd, size, pr);
+			}
+			if (errno != ENXIO) {
+				return errno;
+			}
+			data = size;    /* There's only a hole left */
+		}
+		if (data > size) {
+			data = size;
+		}
+		skipped += data - hole;
+		if (punch && data > hole &&
+		    fallocate(out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole,
+		              data - hole) < 0) {
+			return errno;
+		}
+		if (data == size) {
+			break;
+		}
+
+		if ((hole = lseek(in_fd, data, SEEK_HOLE)) < 0) {
+			return errno;
+		}
+		if (hole > size) {
+			hole = size;
+		}
+		if (lseek(out_fd, data, SEEK_SET) < 0) {
+			return errno;
+		}
+		while (data < hole) {
+			if ((retval = progress_check(pr))) {
+				return retval;
+			}
+			sent = sendfile(out_fd, in_fd, &data,
+			                hole - data > COPY_CHUNK ? COPY_CHUNK : hole - data);
+			if (sent < 0) {
+				return errno;
+			}
+			if (sent == 0) {    /* Source got truncated while we were copying */
+				size = data;
+				break;
+			}
+			if ((retval = progress_throttle(pr, sent, 0))) {
+				return retval;
+			}
+		}
+	}
+
+	/* Trailing holes don't get created by writing past them */
+	if (ftruncate(out_fd, size) < 0) {
+		return errno;
+	}
+
+	__atomic_fetch_add(&pr->holes, skipped, __ATOMIC_RELAXED);
 
 	return 0;
 }
+
+/* Copy a single node. Directories are created on the way down, and paired
+ * with the source directory so that their contents can be created inside */
+int
+copy_node(Walk *w, int event, int dirfd, const char *name,
+          const struct stat *st)
+{
+	struct copy_ctx *cp;
+	struct dir_times *dt;
+	struct stat dirst;
+	const char *dest;
+	char path[PATH_MAX], *srcpath;
+	int destfd, retval;
+
+	cp = w->arg;
+
+	/* The root of the copy can be renamed along the way */
+	destfd = (w->depth ? w->ufd : cp->destfd);
+	dest = (w->depth ? name : cp->destname);
+
+	retval = 0;
+	switch (event) {
+	case WALK_DIR_PRE:
+		/* Directory fds are about to change, don't reuse the batch ones */
+		if (cp->batch) {
+			cp->batch->last_in = -1;
+		}
+		if (fstatat(dirfd, name, &dirst, AT_SYMLINK_NOFOLLOW) < 0) {
+			return errno;
+		}
+		/* """copy""" the directory */
+		if (mkdirat(destfd, dest, dirst.st_mode & 07777) < 0 && errno != EEXIST) {
+			return errno;
+		}
+		if ((w->child_ufd = openat(destfd, dest,
+		                           O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+			return errno;
+		}
+
+		/* Creating the contents changes the mtime, and the batch may create
+		 * them late: the timestamps are set once the whole copy is over */
+		dt = safealloc(sizeof(*dt) + strlen(cp->dest) +
+		               strlen(w->path + cp->srclen) + 1 +
+		               (cp->move ? strlen(w->path) + 1 : 0));
+		sprintf(dt->path, "%s%s", cp->dest, w->path + cp->srclen);
+		dt->src = NULL;
+		if (cp->move) {
+			dt->src = dt->path + strlen(dt->path) + 1;
+			strcpy(dt->src, w->path);
+		}
+		dt->times[0] = dirst.st_atim;
+		dt->times[1] = dirst.st_mtim;
+		dt->next = cp->dirs;
+		cp->dirs = dt;
+		return 0;
+	case WALK_DIR_POST:
+		if (cp->batch) {
+			cp->batch->last_in = -1;
+		}
+		if (m_opts.durability == DURABLE_STRICT && w->child_ufd >= 0 &&
+		    fsync(w->child_ufd) < 0) {
+			retval = errno;
+		}
+		break;
+	case WALK_FILE:
+		/* Regular files might turn out to be hardlinks, which need to know
+		 * where their first copy went. Plain copies only find out once the
+		 * file is opened, so the path is built on the stack, not allocated.
+		 * One too long to fit is never linked to */
+		if (snprintf(path, sizeof(path), "%s%s", cp->dest,
+		             w->path + cp->srclen) >= (int)sizeof(path)) {
+			*path = '\0';
+		}
+
+		/* Syncs leave up to date files alone. Other links to them can still
+		 * be made to where they are */
+		if (cp->sync && S_ISREG(st->st_mode) &&
+		    up_to_date(dirfd, name, destfd, dest, st)) {
+			if (st->st_nlink > 1 &&
+			    !linkmap_get(cp->links, st->st_dev, st->st_ino)) {
+				linkmap_put(cp->links, st->st_dev, st->st_ino, path);
+			}
+			if (cp->move) {
+				verify_queue(cp->verify, w->path, path, 0);
+			}
+
+			__atomic_fetch_add(&cp->pr->skipped, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&cp->pr->skipped_bytes, st->st_size,
+			                   __ATOMIC_RELAXED);
+			return 0;
+		}
+
+		/* Regular files go through the batch, if there is one. Moves don't
+		 * hold up big ones there: they're worth freeing right away */
+		if (cp->batch && S_ISREG(st->st_mode) &&
+		    !(cp->move && st->st_size > URING_MAXSIZE)) {
+			srcpath = NULL;
+			if (cp->verify) {
+				srcpath = safealloc(strlen(w->path) + 1);
+				strcpy(srcpath, w->path);
+			}
+			if ((retval = batch_add(cp->batch, dirfd, name, destfd, dest,
+			                        path, srcpath)) >= 0) {
+				return retval;
+			}
+			/* Out of fds for the batch, the file is copied right away */
+			free(srcpath);
+		}
+
+		retval = copy_node_file(dirfd, name, destfd, dest, st, cp, path);
+		if (!retval && cp->verify && (S_ISREG(st->st_mode) || cp->move)) {
+			verify_queue(cp->verify, w->path, path,
+			             S_ISREG(st->st_mode) ? st->st_size : 0);
+		}
+
+		/* Clean up the mess if the copy failed (read: delete the file if
+		 * something bad happened during the copy */
+		switch (retval) {
+		case ENOMEM:            /* 4 intentional fallthroughs */
+		case EINVAL:
+		case EOVERFLOW:
+		case EIO:
+			unlinkat(destfd, dest, 0);
+			break;
+		default:
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return retval;
+}
+
+/* Copy anything that isn't a directory. Symlinks are recreated rather than
+ * followed, and so are fifos. Sockets and devices are skipped by copies, and
+ * recreated by moves, which would lose them otherwise */
+int
+copy_node_file(int in_dirfd, const char *src, int out_dirfd, const char *dest,
+               const struct stat *st, struct copy_ctx *cp, const char *path)
+{
+	char target[PATH_MAX+1], old[PATH_MAX];
+	const char *link;
+	struct stat src_st;
+	struct timespec times[2];
+	ssize_t len;
+	int in_fd, out_fd, retval;
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFLNK:
+		if ((len = readlinkat(in_dirfd, src, target, PATH_MAX)) < 0) {
+			return errno;
+		}
+		target[len] = '\0';
+		if (symlinkat(target, out_dirfd, dest) < 0) {
+			if (errno != EEXIST) {
+				return errno;
+			}
+			/* Leave alone a link that's already right, replace any other */
+			len = readlinkat(out_dirfd, dest, old, PATH_MAX);
+			if (len == (ssize_t)strlen(target) && !memcmp(old, target, len)) {
+				return 0;
+			}
+			if (unlinkat(out_dirfd, dest, 0) < 0 ||
+			    symlinkat(target, out_dirfd, dest) < 0) {
+				return errno;
+			}
+		}
+		return 0;
+	case S_IFIFO:
+		if (fstatat(in_dirfd, src, &src_st, AT_SYMLINK_NOFOLLOW) < 0) {
+			return errno;
+		}
+		if (mkfifoat(out_dirfd, dest, src_st.st_mode & 07777) < 0) {
+			return errno;
+		}
+		times[0] = src_st.st_atim;
+		times[1] = src_st.st_mtim;
+		utimensat(out_dirfd, dest, times, AT_SYMLINK_NOFOLLOW);
+		return 0;
+	case S_IFREG:
+		break;
+	case S_IFCHR:           /* 2 intentional fallthroughs */
+	case S_IFBLK:
+	case S_IFSOCK:
+		/* One already there is checked by the verifier, like the rest */
+		if (cp->move && mknodat(out_dirfd, dest, st->st_mode,
+		                        st->st_rdev) < 0 && errno != EEXIST) {
+			return errno;
+		}
+		return 0;
+	default:
+		return 0;
+	}
+
+	if ((in_fd = openat(in_dirfd, src, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		return errno;
+	}
+	if (fstat(in_fd, &src_st) < 0) {
+		retval = errno;
+		close(in_fd);
+		return retval;
+	}
+
+	/* Already copied under another name, just link it */
+	if (src_st.st_nlink > 1 &&
+	    (link = linkmap_get(cp->links, src_st.st_dev, src_st.st_ino))) {
+		close(in_fd);
+		return relink(link, out_dirfd, dest);
+	}
+
+	if ((out_fd = openat(out_dirfd, dest, O_WRONLY|O_CREAT|O_CLOEXEC,
+	                     src_st.st_mode & 07777)) >= 0) {
+		if (src_st.st_nlink > 1) {
+			linkmap_put(cp->links, src_st.st_dev, src_st.st_ino, path);
+		}
+		if (IS_SPARSE(src_st.st_blocks, src_st.st_size)) {
+			retval = copy_holes(in_fd, out_fd, src_st.st_size, cp->pr);
+		} else {
+			retval = copy_fd(in_fd, out_fd, src_st.st_size, cp->pr);
+		}
+		/* Keep the timestamps, for syncs to tell the copy is up to date */
+		if (!retval) {
+			times[0] = src_st.st_atim;
+			times[1] = src_st.st_mtim;
+			futimens(out_fd, times);
+
+			__atomic_fetch_add(&cp->pr->bytes, src_st.st_size,
+			                   __ATOMIC_RELAXED);
+		}
+		if (!retval && m_opts.durability == DURABLE_STRICT &&
+		    fsync(out_fd) < 0) {
+			retval = errno;
+		}
+		close(out_fd);
+	} else {
+		retval = errno;
+	}
+	close(in_fd);
+
+	return retval;
+}
+
+/* Copy src to dest, either all of it or, if syncing, only the files that
+ * differ from the ones already there. flags is a bitmask of enum copy_flags.
+ * Moves hand every node over to the verifier, which removes its source once
+ * the copy is safe, while the walk goes on copying the next ones */
+int
+copy_tree(char *src, char *dest, int flags, Progress *pr)
+{
+	struct copy_ctx cp;
+	struct dir_times *dt;
+	int copy_status, batch_status;
+	Linkmap links;
+
+	memset(&links, '\0', sizeof(links));
+	cp.links = &links;
+	cp.verify = NULL;
+	if (m_opts.verify || flags & COPY_MOVE) {
+		cp.verify = verify_start(pr, (m_opts.verify ? VERIFY_HASH : 0) |
+		                         (flags & COPY_MOVE ? VERIFY_REMOVE : 0));
+	}
+	cp.pr = pr;
+	cp.dirs = NULL;
+	cp.sync = flags & COPY_SYNC;
+	/* Without a verifier, the sources can only go once it's all copied */
+	cp.move = (flags & COPY_MOVE && cp.verify);
+
+	/* Small files get batched through io_uring if the kernel supports it.
+	 * Otherwise, batch is NULL and every file goes through sendfile() */
+	if ((cp.batch = batch_new())) {
+		cp.batch->links = cp.links;
+		cp.batch->verify = cp.verify;
+		cp.batch->pr = pr;
+		cp.batch->move = cp.move;
+	}
+	copy_status = s_copy_file(src, dest, &cp);
+
+	if (cp.batch) {
+		batch_status = batch_flush(cp.batch);
+		if (!copy_status) {
+			copy_status = batch_status;
+		}
+		batch_free(cp.batch);
+	}
+	linkmap_free(&links);
+
+	/* A corrupted copy is worth knowing about, but not worth deleting */
+	if (cp.verify && verify_finish(cp.verify) > 0 && !copy_status) {
+		copy_status = EBADMSG;
+	}
+
+	/* Nothing is going to touch the directories anymore. Their timestamps
+	 * are only kept on a best effort basis, like everything else's. The
+	 * list starts from the last one entered, so sources are emptied first */
+	while ((dt = cp.dirs)) {
+		cp.dirs = dt->next;
+		utimensat(AT_FDCWD, dt->path, dt->times, 0);
+		if (dt->src && rmdir(dt->src) < 0 && errno != ENOTEMPTY &&
+		    !copy_status) {
+			copy_status = errno;
+		}
+		free(dt);
+	}
+
+	if (flags & COPY_MOVE && !cp.move && !copy_status) {
+		copy_status = s_delete_file(src, pr);
+	}
+	if (flags & COPY_MOVE) {
+		parent_changed(src);
+	}
+
+	/* Some of a move may be gone from the source already, keep it all. A
+	 * sync's destination was there before, and is mostly up to date: only the
+	 * files that failed are removed, as they fail */
+	switch (flags & (COPY_MOVE | COPY_SYNC) ? 0 : copy_status) {
+	case ENOMEM:    /* 4 intentional fallthroughs */
+	case EINVAL:
+	case EOVERFLOW:
+	case EIO:
+		delete_file(dest, pr);
+		break;
+	default:
+		break;
+	}
+
+	parent_changed(dest);
+
+	return copy_status;
+}
+
+/* Count nodes, for enumerate_dir() */
+int
+count_node(Walk *w, int event, int dirfd, const char *name,
+           const struct stat *st)
+{
+	if (event != WALK_DIR_POST) {
+		(*(unsigned*)w->arg)++;
+	}
+	return 0;
+}
+
+/* Delete a single node. Directories are deleted on the way back up, once
+ * their contents are gone, to prevent an ENOTEMPTY */
+int
+delete_node(Walk *w, int event, int dirfd, const char *name,
+            const struct stat *st)
+{
+	if (event == WALK_DIR_PRE) {
+		return 0;
+	}
+
+	if (unlinkat(dirfd, name, event == WALK_DIR_POST ? AT_REMOVEDIR : 0) < 0) {
+		return errno;
+	}
+
+	return 0;
+}
+
+/* Count the nodes in a tree. Operations don't need this beforehand, as they
+ * refine the progress totals while they go */
+unsigned
+enumerate_dir(char *path)
+{
+	unsigned count;
+
+	count = 0;
+	walk_tree(path, count_node, &count, 0, NULL);
+
+	return count;
+}
+
+/* Free all the paths held by a link map */
+void
+linkmap_free(Linkmap *map)
+{
+	size_t i;
+
+	for (i=0; i<map->size; i++) {
+		free(map->slots[i].path);
+	}
+	free(map->slots);
+	memset(map, '\0', sizeof(*map));
+}
+
+/* Look up where a file has been copied to. Returns NULL if it hasn't been */
+const char *
+linkmap_get(const Linkmap *map, dev_t dev, ino_t ino)
+{
+	size_t i;
+
+	if (!map->size) {
+		return NULL;
+	}
+
+	/* Open addressing with linear probing, the map is never full */
+	for (i = LINKMAP_HASH(dev, ino) & (map->size - 1); map->slots[i].path;
+	     i = (i + 1) & (map->size - 1)) {
+		if (map->slots[i].dev == dev && map->slots[i].ino == ino) {
+			return map->slots[i].path;
+		}
+	}
+
+	return NULL;
+}
+
+/* Remember that a file has been copied to path. The map grows once it's half
+ * full, to keep the probe sequences short. Copies whose path was too long to
+ * build aren't remembered */
+void
+linkmap_put(Linkmap *map, dev_t dev, ino_t ino, const char *path)
+{
+	struct link_slot *old;
+	size_t i, oldsize;
+
+	if (!*path) {
+		return;
+	}
+	if (2 * (map->count + 1) > map->size) {
+		old = map->slots;
+		oldsize = map->size;
+		map->size = (oldsize ? 2 * oldsize : 64);
+		map->slots = safealloc(sizeof(*map->slots) * map->size);
+		memset(map->slots, '\0', sizeof(*map->slots) * map->size);
+		map->count = 0;
+		for (i=0; i<oldsize; i++) {
+			if (old[i].path) {
+				linkmap_put(map, old[i].dev, old[i].ino, old[i].path);
+				free(old[i].path);
+			}
+		}
+		free(old);
+	}
+
+	for (i = LINKMAP_HASH(dev, ino) & (map->size - 1); map->slots[i].path;
+	     i = (i + 1) & (map->size - 1))
+		;
+
+	map->slots[i].dev = dev;
+	map->slots[i].ino = ino;
+	map->slots[i].path = safealloc(strlen(path) + 1);
+	strcpy(map->slots[i].path, path);
+	map->count++;
+}
+
+/* Hash the contents of a file, for up_to_date() */
+int
+file_digest(int dirfd, const char *name, uint64_t *digest)
+{
+	char buf[64 * 1024];
+	Hash h;
+	ssize_t n;
+	int fd, retval;
+
+	if ((fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		return errno;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	hash_init(&h, 0);
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		hash_update(&h, buf, n);
+	}
+	retval = (n < 0 ? errno : 0);
+	close(fd);
+
+	*digest = hash_digest(&h);
+	return retval;
+}
+
+/* Tell the main thread that the directory holding path has changed */
+void
+parent_changed(const char *path)
+{
+	char *parent, *slash;
+
+	parent = safealloc(sizeof(*parent) * (strlen(path) + 2));
+	strcpy(parent, path);
+	if ((slash = strrchr(parent, '/'))) {
+		slash[slash == parent ? 1 : 0] = '\0';
+	} else {
+		strcpy(parent, ".");
+	}
+
+	queue_master_update(UPDATE_DIRS, parent);
+	free(parent);
+}
+
+/* Hardlink name in dirfd to target, replacing whatever is in the way like a
+ * copy would */
+int
+relink(const char *target, int dirfd, const char *name)
+{
+	if (linkat(AT_FDCWD, target, dirfd, name, 0) < 0) {
+		if (errno != EEXIST || unlinkat(dirfd, name, 0) < 0 ||
+		    linkat(AT_FDCWD, target, dirfd, name, 0) < 0) {
+			return errno;
+		}
+	}
+
+	return 0;
+}
+
+/* Recursive chmodding of a directory and its children. Nodes only depend on
+ * their own directory being reachable, so whole subtrees are done in parallel.
+ * Possible TODO: add an option to just chmod the top level file */
+int
+s_chmod_file(char *name, const Perms *perms, Progress *pr)
+{
+	int retval;
+
+	/* Telling what's right already takes the modes and owners */
+	retval = walk_tree_parallel(name, chmod_node, (void*)perms, WALK_STAT, pr,
+	                            m_opts.threads);
+
+	progress_name(pr, NULL);
+
+	return retval;
+}
+
+/* Recursive copying backend. cp comes with the batch, link map and verifier
+ * to use, if any; the rest is filled in here */
+int
+s_copy_file(char *src, char *dest, struct copy_ctx *cp)
+{
+	char *parent, *slash;
+	int retval;
+
+	/* Split dest into its parent directory, and the name of the copy */
+	parent = safealloc(sizeof(*parent) * (strlen(dest) + 2));
+	strcpy(parent, dest);
+	if ((slash = strrchr(parent, '/'))) {
+		cp->destname = dest + (slash - parent) + 1;
+		slash[slash == parent ? 1 : 0] = '\0';
+	} else {
+		cp->destname = dest;
+		strcpy(parent, ".");
+	}
+
+	if ((cp->destfd = open(parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		free(parent);
+		return errno;
+	}
+	free(parent);
+
+	cp->dest = dest;
+	cp->srclen = strlen(src);
+	/* Syncs need sizes and mtimes, and so do moves, to check the copies */
+	retval = walk_tree(src, copy_node, cp, cp->sync || cp->move ? WALK_STAT : 0,
+	                   cp->pr);
+
+	/* Directories sync their own contents, but the root is nobody's content */
+	if (m_opts.durability == DURABLE_STRICT && fsync(cp->destfd) < 0 &&
+	    !retval) {
+		retval = errno;
+	}
+
+	/* The batch holds its own fds, it's safe to flush it later */
+	close(cp->destfd);
+
+	progress_name(cp->pr, NULL);
+
+	return retval;
+}
+
+/* Recursive deletion. Directories don't depend on each other until they're
+ * removed, so whole subtrees can be emptied in parallel */
+int
+s_delete_file(char *name, Progress *pr)
+{
+	int retval;
+
+	retval = walk_tree_parallel(name, delete_node, NULL, 0, pr, m_opts.threads);
+
+	progress_name(pr, NULL);
+
+	return retval;
+}
+
+/* Sum the space taken up by files, for tree_size() */
+int
+size_node(Walk *w, int event, int dirfd, const char *name,
+          const struct stat *st)
+{
+	if (event == WALK_FILE) {
+		__atomic_add_fetch((off_t*)w->arg, (off_t)st->st_blocks * 512,
+		                   __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/* Flush the directory containing path, so that its entry for path is on disk */
+int
+sync_parent(const char *path)
+{
+	char *parent, *slash;
+	int fd, retval;
+
+	parent = safealloc(sizeof(*parent) * (strlen(path) + 2));
+	strcpy(parent, path);
+	if ((slash = strrchr(parent, '/'))) {
+		slash[slash == parent ? 1 : 0] = '\0';
+	} else {
+		strcpy(parent, ".");
+	}
+
+	retval = 0;
+	if ((fd = open(parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0 || fsync(fd) < 0) {
+		retval = errno;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(parent);
+
+	return retval;
+}
+
+/* Tell whether dest is already a copy of the regular file src: same size, and
+ * same mtime or, with sync_hash, same contents. Contents that turn out to be
+ * the same get their timestamps fixed, so that the next sync can tell sooner */
+int
+up_to_date(int in_dirfd, const char *src, int out_dirfd, const char *dest,
+           const struct stat *st)
+{
+	struct stat dest_st;
+	struct timespec times[2];
+	uint64_t src_digest, dest_digest;
+
+	if (fstatat(out_dirfd, dest, &dest_st, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    !S_ISREG(dest_st.st_mode) || dest_st.st_size != st->st_size) {
+		return 0;
+	}
+
+	if (!m_opts.sync_hash) {
+		return dest_st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		       dest_st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+	}
+
+	if (file_digest(in_dirfd, src, &src_digest) ||
+	    file_digest(out_dirfd, dest, &dest_digest) ||
+	    src_digest != dest_digest) {
+		return 0;
+	}
+
+	times[0] = st->st_atim;
+	times[1] = st->st_mtim;
+	utimensat(out_dirfd, dest, times, AT_SYMLINK_NOFOLLOW);
+	return 1;
+}
 /*}}}*/
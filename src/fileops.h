@@ -3,36 +3,139 @@
  * just wrappers around recursive, statically-defined functions in the companion
  * .c file. The Progress struct is used to report to the main thread how far
  * into an operation we are, as well as the name of the file currently being
- * copied/deleted/linked/chmodded/you_name_it.
+ * copied/deleted/linked/chmodded/you_name_it. The total object count is
+ * refined as operations discover new files, rather than known in advance.
+ * Reporting never takes a lock: the workers bump atomic counters and copy the
+ * file name into a slot of the struct, which the UI reads back as a whole with
+ * progress_read().
+ * Every job has a Progress struct of its own, which also tells the operations
+ * working for it whether they should pause or give up: they check that with
+ * progress_check() every now and then, and stop with ECANCELED if asked to.
+ * Operations can be throttled, both one job at a time and all of them
+ * together, by token buckets on bytes and objects per second: the operations
+ * pay for what they've done with progress_throttle(), which also checks the
+ * job like progress_check() does, and waits there if they're going too fast.
  */
 
 #ifndef FILEOPS_H_MINE
 #define FILEOPS_H_MINE
 
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <time.h>
+#include "perms.h"
 
 #define MODE_DEFAULT 0755
+#define PROGRESS_ERRLEN 128
 
+/* What the operations reporting to a Progress struct are asked to do */
+enum progress_controls {
+	PROGRESS_RUN,
+	PROGRESS_PAUSE,
+	PROGRESS_CANCEL
+};
+
+/* Token bucket, limiting how fast something can go */
+typedef struct {
+	unsigned long rate;     /* Tokens per second, 0 for no limit */
+	double tokens;          /* Below zero, it's a debt to be waited out */
+	struct timespec last;   /* When tokens were last added */
+} Bucket;
+
+/* The counters are only ever touched through atomics, and the name of the
+ * current file is behind a seqlock: use progress_read() to get a snapshot of
+ * them. The mutex only guards error, the control changes and the buckets */
 typedef struct {
-	char *fname;
 	unsigned obj_count;
 	unsigned obj_done;
+	unsigned long bytes;    /* Data copied so far */
+	unsigned long holes;    /* Bytes not copied, since they were holes */
+	unsigned mismatches;    /* Copies that failed verification */
+	unsigned skipped;       /* Files a sync found already up to date */
+	unsigned long skipped_bytes;
+	unsigned seq;           /* Odd while fname is being rewritten */
+	char fname[PATH_MAX];   /* Last file worked on, empty if none */
+	char error[PROGRESS_ERRLEN];    /* Why the last operation failed, if it did */
+	int control;        /* One of enum progress_controls */
+	Bucket bps, ops;    /* Limits on this job alone */
+	struct journal *journal;    /* Where the job notes what's done, if it does */
 	pthread_mutex_t mutex;
+	pthread_cond_t cond;    /* Signalled when control changes */
 } Progress;
 
+/* What a Progress struct said at some point, as progress_read() gets it */
+typedef struct {
+	unsigned obj_count, obj_done;
+	unsigned long bytes, holes, skipped_bytes;
+	unsigned mismatches, skipped;
+	int control;
+	char fname[PATH_MAX];
+} Progstat;
+
+/* How hard copies and moves try to make sure their results survive a crash */
+enum durability {
+	DURABLE_NONE,       /* Leave it to the kernel */
+	DURABLE_BATCH,      /* syncfs() the destination once the job is over */
+	DURABLE_STRICT      /* fsync() every file and directory as it's done */
+};
+
+/* I/O scheduling classes, as ioprio_set() takes them */
+enum io_classes {
+	IOCLASS_NONE,       /* Leave it alone */
+	IOCLASS_RT,
+	IOCLASS_BE,         /* Best effort, levels 0 (highest) to 7 */
+	IOCLASS_IDLE        /* Only when no one else needs the disk */
+};
+
+/* Tunables, set in config.h */
+typedef struct {
+	int threads;        /* Worker threads for operations that can fan out */
+	int preflight;      /* Check for free space before copying */
+	off_t bulk_size;    /* Copy files this big without caching them, 0=never */
+	int durability;     /* One of enum durability */
+	int verify;         /* Hash copies and their sources to compare them */
+	int sync_hash;      /* Syncs tell changed files by content, not mtime */
+	unsigned long max_bps, max_ops; /* Limits on all the jobs together */
+	unsigned long job_bps, job_ops; /* Limits new jobs start with */
+	int nice;           /* Added to the nice value of the worker threads */
+	int ioclass;        /* I/O class of the worker threads, enum io_classes */
+	int iolevel;        /* and their level within it */
+	int trash;          /* Deleting moves files to the trash, see trash.h */
+	off_t trash_size;   /* Purge the oldest trashed files past this, 0=never */
+	int trash_days;     /* and those trashed this many days ago, 0=never */
+	int undo;           /* Batches of moves and trashings kept, see undo.h */
+} Fileopts;
+
 unsigned enumerate_dir(char *path);
-Progress *fileop_progress();
-void fileops_deinit();
-void fileops_init();
+const Fileopts *fileop_opts();
+void fileops_init(const Fileopts *opts);
+void fileops_worker_init();
+void progress_add(Progress *pr, unsigned found, unsigned done,
+                  const char *fname);
+int  progress_check(Progress *pr);
+void progress_control(Progress *pr, int control);
+void progress_deinit(Progress *pr);
+void progress_error(Progress *pr, const char *fmt, ...);
+void progress_init(Progress *pr);
+void progress_limit(Progress *pr, unsigned long bps, unsigned long ops);
+void progress_name(Progress *pr, const char *fname);
+void progress_read(Progress *pr, Progstat *st);
+int  progress_throttle(Progress *pr, unsigned long bytes, unsigned ops);
+int  space_check(const char *path, off_t need, Progress *pr);
+void throttle_get(unsigned long *bps, unsigned long *ops);
+void throttle_set(unsigned long bps, unsigned long ops);
+off_t tree_size(char *path);
 
-int  chmod_file(char *name, mode_t mode);
-int  copy_file(char *src, char *dest);
-int  delete_file(char *name);
-int  link_file(char *src, char *dest);
-int  move_file(char *src, char *dest);
+int  chmod_file(char *name, const Perms *perms, Progress *pr);
+int  copy_file(char *src, char *dest, Progress *pr);
+int  delete_file(char *name, Progress *pr);
+int  link_file(char *src, char *dest, Progress *pr);
+int  move_file(char *src, char *dest, Progress *pr);
+int  sync_file(char *src, char *dest, Progress *pr);
 
 int  file_mkdir(const char *name, const char *path);
 int  file_touch(const char *name, const char *path);
+int  file_syncfs(const char *path);
 
 #endif
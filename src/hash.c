@@ -0,0 +1,143 @@
+#include <string.h>
+#include "hash.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+#define ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t hash_merge(uint64_t acc, uint64_t val);
+static uint32_t hash_read32(const unsigned char *p);
+static uint64_t hash_read64(const unsigned char *p);
+static uint64_t hash_round(uint64_t acc, uint64_t input);
+
+/* Hash of everything fed to h so far. h is left untouched, so it can be
+ * updated further */
+uint64_t
+hash_digest(const Hash *h)
+{
+	const unsigned char *p, *end;
+	uint64_t digest;
+
+	if (h->total >= 32) {
+		digest = ROTL(h->acc[0], 1) + ROTL(h->acc[1], 7) +
+		         ROTL(h->acc[2], 12) + ROTL(h->acc[3], 18);
+		digest = hash_merge(digest, h->acc[0]);
+		digest = hash_merge(digest, h->acc[1]);
+		digest = hash_merge(digest, h->acc[2]);
+		digest = hash_merge(digest, h->acc[3]);
+	} else {
+		digest = h->seed + P5;
+	}
+	digest += h->total;
+
+	/* Fold in the tail that didn't fill a whole stripe */
+	p = h->buf;
+	end = h->buf + h->buflen;
+	for (; p + 8 <= end; p += 8) {
+		digest ^= hash_round(0, hash_read64(p));
+		digest = ROTL(digest, 27) * P1 + P4;
+	}
+	if (p + 4 <= end) {
+		digest ^= hash_read32(p) * P1;
+		digest = ROTL(digest, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		digest ^= *p * P5;
+		digest = ROTL(digest, 11) * P1;
+	}
+
+	/* Avalanche */
+	digest ^= digest >> 33;
+	digest *= P2;
+	digest ^= digest >> 29;
+	digest *= P3;
+	digest ^= digest >> 32;
+
+	return digest;
+}
+
+void
+hash_init(Hash *h, uint64_t seed)
+{
+	memset(h, '\0', sizeof(*h));
+	h->seed = seed;
+	h->acc[0] = seed + P1 + P2;
+	h->acc[1] = seed + P2;
+	h->acc[2] = seed;
+	h->acc[3] = seed - P1;
+}
+
+/* Feed len more bytes to h */
+void
+hash_update(Hash *h, const void *data, size_t len)
+{
+	const unsigned char *p, *end;
+	size_t fill;
+
+	p = data;
+	end = p + len;
+	h->total += len;
+
+	/* Complete the stripe left over from last time, if there's enough */
+	if (h->buflen + len < 32) {
+		memcpy(h->buf + h->buflen, p, len);
+		h->buflen += len;
+		return;
+	}
+	if (h->buflen > 0) {
+		fill = 32 - h->buflen;
+		memcpy(h->buf + h->buflen, p, fill);
+		h->acc[0] = hash_round(h->acc[0], hash_read64(h->buf));
+		h->acc[1] = hash_round(h->acc[1], hash_read64(h->buf + 8));
+		h->acc[2] = hash_round(h->acc[2], hash_read64(h->buf + 16));
+		h->acc[3] = hash_round(h->acc[3], hash_read64(h->buf + 24));
+		p += fill;
+		h->buflen = 0;
+	}
+
+	for (; p + 32 <= end; p += 32) {
+		h->acc[0] = hash_round(h->acc[0], hash_read64(p));
+		h->acc[1] = hash_round(h->acc[1], hash_read64(p + 8));
+		h->acc[2] = hash_round(h->acc[2], hash_read64(p + 16));
+		h->acc[3] = hash_round(h->acc[3], hash_read64(p + 24));
+	}
+
+	memcpy(h->buf, p, end - p);
+	h->buflen = end - p;
+}
+
+/* Static functions {{{*/
+uint64_t
+hash_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= hash_round(0, val);
+	return acc * P1 + P4;
+}
+
+/* Little endian reads, whatever the host is */
+uint32_t
+hash_read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[3] << 24;
+}
+
+uint64_t
+hash_read64(const unsigned char *p)
+{
+	return (uint64_t)hash_read32(p) | (uint64_t)hash_read32(p + 4) << 32;
+}
+
+uint64_t
+hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	acc = ROTL(acc, 31);
+	return acc * P1;
+}
+/*}}}*/
@@ -0,0 +1,26 @@
+/**
+ * Streaming implementation of XXH64, a fast non-cryptographic hash, used to
+ * check that copied data made it to its destination intact. The four
+ * independent accumulators let the CPU work on 32 bytes at a time, which is
+ * enough to keep up with the disks.
+ */
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint64_t acc[4];
+	uint64_t seed;
+	uint64_t total;             /* Bytes hashed so far */
+	unsigned char buf[32];      /* Bytes left over from the last update */
+	size_t buflen;
+} Hash;
+
+uint64_t hash_digest(const Hash *h);
+void     hash_init(Hash *h, uint64_t seed);
+void     hash_update(Hash *h, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,560 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "clipboard.h"
+#include "fileops.h"
+#include "jobs.h"
+#include "sheriff.h"
+#include "undo.h"
+#include "utils.h"
+
+static void  job_describe(Job *job);
+static void  job_devices(Job *job);
+static Job*  job_find(unsigned id);
+static int   job_may_run(Job *job);
+static Job*  job_next();
+static unsigned job_queue(Clipboard *clip, char *destpath, Journal *journal);
+static void* job_runner(void *arg);
+static void  jobs_prune();
+
+static const char *m_opnames[OP_NR] = {
+	[OP_COPY] = "copy",
+	[OP_MOVE] = "move",
+	[OP_LINK] = "link",
+	[OP_DELETE] = "delete",
+	[OP_CHMOD] = "chmod",
+	[OP_SYNC] = "sync",
+	[OP_PURGE] = "purge",
+	[OP_UNDO] = "undo",
+};
+
+static Jobopts m_opts;
+static Job *m_jobs;                 /* In submission order */
+static unsigned m_last_id;
+static int m_quit;                  /* Runners should exit */
+static pthread_t *m_runners;
+static pthread_mutex_t m_mutex;
+static pthread_cond_t m_cond;       /* Signalled when there's a job to run */
+
+/* Id of the idxth job in the list, 0 if there's no such job */
+unsigned
+job_at(int idx)
+{
+	Job *job;
+	unsigned id;
+
+	pthread_mutex_lock(&m_mutex);
+	for (job = m_jobs; job && idx > 0; job = job->next, idx--)
+		;
+	id = (job && idx == 0 ? job->id : 0);
+	pthread_mutex_unlock(&m_mutex);
+
+	return id;
+}
+
+/* Cancel a job. Queued jobs are dropped on the spot, running ones stop as soon
+ * as they can. Returns ENOENT if there's no such job, or it's over already */
+int
+job_cancel(unsigned id)
+{
+	Job *job;
+	int retval;
+
+	retval = 0;
+	pthread_mutex_lock(&m_mutex);
+	if (!(job = job_find(id)) || job->state > JOB_RUNNING) {
+		retval = ENOENT;
+	} else if (job->state == JOB_QUEUED) {
+		job->state = JOB_CANCELLED;
+		clip_free(job->clip);
+		free(job->destpath);
+		journal_close(job->progress.journal, 0);
+		job->clip = NULL;
+		job->destpath = NULL;
+		job->progress.journal = NULL;
+		jobs_prune();
+	} else {
+		progress_control(&job->progress, PROGRESS_CANCEL);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+	return retval;
+}
+
+/* Limit how fast a job goes, in bytes and objects per second, 0 meaning no
+ * limit. Returns ENOENT if there's no such job, or it's over already */
+int
+job_limit(unsigned id, unsigned long bps, unsigned long ops)
+{
+	Job *job;
+	int retval;
+
+	retval = 0;
+	pthread_mutex_lock(&m_mutex);
+	if (!(job = job_find(id)) || job->state > JOB_RUNNING) {
+		retval = ENOENT;
+	} else {
+		progress_limit(&job->progress, bps, ops);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+	return retval;
+}
+
+/* Pause a job, or let it go on if it's paused already. A paused job stops
+ * where it is if it's running, and isn't started if it's queued */
+int
+job_pause(unsigned id)
+{
+	Job *job;
+	int retval;
+
+	retval = 0;
+	pthread_mutex_lock(&m_mutex);
+	if (!(job = job_find(id)) || job->state > JOB_RUNNING) {
+		retval = ENOENT;
+	} else if (job->progress.control == PROGRESS_PAUSE) {
+		progress_control(&job->progress, PROGRESS_RUN);
+		pthread_cond_broadcast(&m_cond);   /* A queued one might be next */
+	} else {
+		progress_control(&job->progress, PROGRESS_PAUSE);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+	return retval;
+}
+
+/* Name of a clipboard operation, for the UI */
+const char *
+job_opname(int op)
+{
+	return op >= 0 && op < OP_NR ? m_opnames[op] : "???";
+}
+
+/* Change the priority of a job that hasn't started yet */
+int
+job_prioritize(unsigned id, int delta)
+{
+	Job *job;
+	int retval;
+
+	retval = 0;
+	pthread_mutex_lock(&m_mutex);
+	if (!(job = job_find(id)) || job->state != JOB_QUEUED) {
+		retval = ENOENT;
+	} else {
+		job->priority += delta;
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+	return retval;
+}
+
+/* Queue a job left behind by an earlier run, as its journal has it. The job
+ * takes ownership of clip, destpath and journal. Returns the id of the job */
+unsigned
+job_resume(Clipboard *clip, char *destpath, Journal *journal)
+{
+	return job_queue(clip, destpath, journal);
+}
+
+/* Queue a clipboard snapshot for execution. The job takes ownership of both
+ * clip and destpath. Returns the id of the new job */
+unsigned
+job_submit(Clipboard *clip, char *destpath)
+{
+	Journal *journal;
+
+	journal = NULL;
+	if (m_opts.journal && (clip->op == OP_COPY || clip->op == OP_MOVE ||
+	    clip->op == OP_SYNC || clip->op == OP_DELETE)) {
+		journal = journal_open(clip->op, clip->list, destpath);
+	}
+
+	return job_queue(clip, destpath, journal);
+}
+
+/* How fast a job is going, in bytes per second if bytes is set, in objects
+ * per second otherwise. Must be called with the list locked */
+double
+job_throughput(Job *job, int bytes)
+{
+	struct timespec now;
+	double secs, done;
+
+	if (!job->start.tv_sec && !job->start.tv_nsec) {
+		return 0;
+	}
+
+	if (job->state == JOB_RUNNING) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} else {
+		now = job->end;
+	}
+	secs = (now.tv_sec - job->start.tv_sec) +
+	       (now.tv_nsec - job->start.tv_nsec) / 1e9;
+
+	done = (bytes ? __atomic_load_n(&job->progress.bytes, __ATOMIC_RELAXED) :
+	        __atomic_load_n(&job->progress.obj_done, __ATOMIC_RELAXED));
+
+	return secs > 0 ? done / secs : 0;
+}
+
+/* Cancel all the jobs, and wait for the runners to be done with them */
+void
+jobs_deinit()
+{
+	Job *job;
+	int i;
+
+	pthread_mutex_lock(&m_mutex);
+	m_quit = 1;
+	for (job = m_jobs; job; job = job->next) {
+		progress_control(&job->progress, PROGRESS_CANCEL);
+	}
+	pthread_cond_broadcast(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	for (i=0; i<m_opts.runners; i++) {
+		pthread_join(m_runners[i], NULL);
+	}
+	free(m_runners);
+
+	while ((job = m_jobs)) {
+		m_jobs = job->next;
+		if (job->clip) {
+			clip_free(job->clip);
+		}
+		journal_close(job->progress.journal, 1);   /* Never run, resumable */
+		free(job->destpath);
+		free(job->desc);
+		progress_deinit(&job->progress);
+		free(job);
+	}
+
+	pthread_cond_destroy(&m_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+/* Fetch the oldest error left by a job, and clear it. Returns 1 if there was
+ * one, 0 otherwise */
+int
+jobs_error(char *buf, size_t len)
+{
+	Job *job;
+	int found;
+
+	found = 0;
+	pthread_mutex_lock(&m_mutex);
+	for (job = m_jobs; job && !found; job = job->next) {
+		pthread_mutex_lock(&job->progress.mutex);
+		if (*job->progress.error) {
+			snprintf(buf, len, "%s", job->progress.error);
+			*job->progress.error = '\0';
+			found = 1;
+		}
+		pthread_mutex_unlock(&job->progress.mutex);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return found;
+}
+
+/* Start the runner threads */
+void
+jobs_init(const Jobopts *opts)
+{
+	int i;
+
+	m_opts = *opts;
+	if (m_opts.runners < 1) {
+		m_opts.runners = 1;
+	}
+
+	pthread_mutex_init(&m_mutex, NULL);
+	pthread_cond_init(&m_cond, NULL);
+	m_jobs = NULL;
+	m_quit = 0;
+
+	m_runners = safealloc(sizeof(*m_runners) * m_opts.runners);
+	for (i=0; i<m_opts.runners; i++) {
+		pthread_create(m_runners + i, NULL, job_runner, NULL);
+	}
+}
+
+/* Lock the job list and get its head, for the UI to walk it */
+Job *
+jobs_lock()
+{
+	pthread_mutex_lock(&m_mutex);
+	return m_jobs;
+}
+
+void
+jobs_unlock()
+{
+	pthread_mutex_unlock(&m_mutex);
+}
+
+/* Static functions {{{*/
+/* Summarize what a job is about to do, e.g. "copy foo (+2) to /bar" */
+void
+job_describe(Job *job)
+{
+	const Clipboard *clip;
+	const char *name, *op;
+	char more[16], undone[NAME_MAX+32];
+
+	clip = job->clip;
+	op = job_opname(clip->op);
+	name = (clip->list && clip->list->groups[0]->count ?
+	        CLIP_NAME(clip->list->groups[0], 0) : "");
+
+	/* An undo's destpath is the batch it takes back */
+	if (clip->op == OP_UNDO) {
+		undo_describe(job->destpath, undone, sizeof(undone));
+		name = undone;
+	}
+
+	*more = '\0';
+	if (clip->list && clip->list->count > 1) {
+		sprintf(more, " (+%d)", clip->list->count - 1);
+	}
+
+	job->desc = safealloc(strlen(op) + strlen(name) + strlen(more) +
+	                      strlen(job->destpath) + 6);
+	switch (clip->op) {
+	case OP_DELETE:
+		sprintf(job->desc, "%s %s%s", op, name, more);
+		break;
+	case OP_PURGE:
+		sprintf(job->desc, "%s %s", op, job->destpath);
+		break;
+	case OP_UNDO:
+		sprintf(job->desc, "%s %s", op, name);
+		break;
+	case OP_CHMOD:
+		sprintf(job->desc, "%s %s %s%s", op, job->destpath, name, more);
+		break;
+	default:
+		sprintf(job->desc, "%s %s%s to %s", op, name, more, job->destpath);
+		break;
+	}
+}
+
+/* Find out which devices a job is going to keep busy: the one it reads from,
+ * and the one it writes to if that's a different one. Files taken from several
+ * directories are counted as being on the first one's device */
+void
+job_devices(Job *job)
+{
+	const Clipboard *clip;
+	struct stat st;
+
+	clip = job->clip;
+	job->ndevs = 0;
+	if (clip->op == OP_UNDO) {      /* Renames, mostly, that needn't wait */
+		return;
+	}
+	if (clip->op == OP_PURGE) {     /* Only the trash itself */
+		if (!stat(job->destpath, &st)) {
+			job->devs[job->ndevs++] = st.st_dev;
+		}
+		return;
+	}
+	if (!clip->list || stat(clip->list->groups[0]->path, &st)) {
+		return;
+	}
+	job->devs[job->ndevs++] = st.st_dev;
+
+	/* A chmod job's destpath is the mode, and a deletion doesn't have one */
+	if (clip->op == OP_DELETE || clip->op == OP_CHMOD ||
+	    stat(job->destpath, &st) || st.st_dev == job->devs[0]) {
+		return;
+	}
+	job->devs[job->ndevs++] = st.st_dev;
+}
+
+/* Look a job up by id. Must be called with the list locked */
+Job *
+job_find(unsigned id)
+{
+	Job *job;
+
+	for (job = m_jobs; job && job->id != id; job = job->next)
+		;
+	return job;
+}
+
+/* Check whether the devices a job needs have room for one more job. Must be
+ * called with the list locked */
+int
+job_may_run(Job *job)
+{
+	Job *other;
+	int i, j, busy;
+
+	if (m_opts.per_device <= 0) {
+		return 1;
+	}
+
+	for (i=0; i<job->ndevs; i++) {
+		busy = 0;
+		for (other = m_jobs; other; other = other->next) {
+			if (other->state != JOB_RUNNING) {
+				continue;
+			}
+			for (j=0; j<other->ndevs; j++) {
+				busy += (other->devs[j] == job->devs[i]);
+			}
+		}
+		if (busy >= m_opts.per_device) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Pick the job to run next, if there's any that isn't paused or waiting for a
+ * device. Must be called with the list locked */
+Job *
+job_next()
+{
+	Job *job, *best;
+
+	best = NULL;
+	for (job = m_jobs; job; job = job->next) {
+		if (job->state != JOB_QUEUED ||
+		    __atomic_load_n(&job->progress.control, __ATOMIC_ACQUIRE) ==
+		    PROGRESS_PAUSE || !job_may_run(job)) {
+			continue;
+		}
+		if (m_opts.order == JOBS_FIFO) {
+			return job;
+		}
+		if (!best || job->priority > best->priority) {
+			best = job;
+		}
+	}
+
+	return best;
+}
+
+/* Add a job to the queue, journaled if journal isn't NULL */
+unsigned
+job_queue(Clipboard *clip, char *destpath, Journal *journal)
+{
+	Job *job, **tail;
+
+	job = safealloc(sizeof(*job));
+	memset(job, '\0', sizeof(*job));
+	progress_init(&job->progress);
+	job->progress.journal = journal;
+	job->clip = clip;
+	job->destpath = destpath;
+	job->state = JOB_QUEUED;
+	if (clip->op >= 0 && clip->op < OP_NR) {
+		job->priority = m_opts.priorities[clip->op];
+	}
+	job_describe(job);
+	job_devices(job);
+
+	pthread_mutex_lock(&m_mutex);
+	job->id = ++m_last_id;
+	for (tail = &m_jobs; *tail; tail = &(*tail)->next)
+		;
+	*tail = job;
+	pthread_cond_signal(&m_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	queue_master_update(UPDATE_STATUS, NULL);
+	return job->id;
+}
+
+/* Body of every runner thread: run jobs as they come, until told to quit */
+void *
+job_runner(void *arg)
+{
+	Job *job;
+	int status;
+
+	fileops_worker_init();
+
+	pthread_mutex_lock(&m_mutex);
+	while (!m_quit) {
+		if (!(job = job_next())) {
+			pthread_cond_wait(&m_cond, &m_mutex);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		clock_gettime(CLOCK_MONOTONIC, &job->start);
+		pthread_mutex_unlock(&m_mutex);
+
+		queue_master_update(UPDATE_STATUS, NULL);
+		status = clip_run(job->clip, job->destpath, &job->progress);
+
+		pthread_mutex_lock(&m_mutex);
+		clock_gettime(CLOCK_MONOTONIC, &job->end);
+		job->status = status;
+		if (job->progress.control == PROGRESS_CANCEL) {
+			job->state = JOB_CANCELLED;
+		} else {
+			job->state = (status ? JOB_FAILED : JOB_DONE);
+		}
+		clip_free(job->clip);
+		free(job->destpath);
+		/* A job that was cut short, or left items undone, can be resumed
+		 * next time */
+		journal_close(job->progress.journal, status == ECANCELED ||
+		              journal_left(job->progress.journal));
+		job->clip = NULL;
+		job->destpath = NULL;
+		job->progress.journal = NULL;
+		jobs_prune();
+
+		/* The devices it used are free, more than one job might be waiting
+		 * on them */
+		pthread_cond_broadcast(&m_cond);
+		queue_master_update(UPDATE_STATUS, NULL);
+	}
+	pthread_mutex_unlock(&m_mutex);
+
+	return NULL;
+}
+
+/* Forget about the oldest finished jobs, so that at most m_opts.keep of them
+ * are listed. Must be called with the list locked */
+void
+jobs_prune()
+{
+	Job *job, **prev;
+	int finished;
+
+	finished = 0;
+	for (job = m_jobs; job; job = job->next) {
+		finished += (job->state > JOB_RUNNING);
+	}
+
+	for (prev = &m_jobs; (job = *prev) && finished > m_opts.keep; ) {
+		if (job->state > JOB_RUNNING && !*job->progress.error) {
+			*prev = job->next;
+			progress_deinit(&job->progress);
+			free(job->desc);
+			free(job);
+			finished--;
+		} else {
+			prev = &job->next;
+		}
+	}
+}
+/*}}}*/
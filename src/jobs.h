@@ -0,0 +1,82 @@
+/**
+ * Scheduler for the operations the clipboard hands out. Jobs wait in a queue
+ * until one of a fixed number of runner threads is free to take them: in
+ * submission order, or highest priority first if the options say so. Each job
+ * reports to a Progress struct of its own, which is also how it's paused,
+ * resumed or cancelled: the file operations check it as they go, and stop at
+ * the first point where it's safe to. Finished jobs stay listed for a while,
+ * so that the UI can show how they went.
+ * Jobs are also scheduled by the devices they touch: a job waits in the queue
+ * while the devices it reads from or writes to are busy with as many jobs as
+ * the options allow, and jobs on other devices get to go ahead of it.
+ * Copies, moves, syncs and deletions keep a journal while they're around, if
+ * the options say so, see journal.h. Jobs that are cut short, or that leave
+ * items undone, keep theirs, and can be resumed on the next run.
+ * The job list is shared with the runners, so anything walking it has to do so
+ * between jobs_lock() and jobs_unlock().
+ */
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <time.h>
+#include <sys/types.h>
+#include "clipboard.h"
+#include "fileops.h"
+#include "journal.h"
+
+enum job_states {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_CANCELLED
+};
+
+/* How the next job to run is picked */
+enum job_orders {
+	JOBS_FIFO,          /* First come, first served */
+	JOBS_PRIORITY       /* Highest priority first, FIFO among equals */
+};
+
+typedef struct job {
+	struct job *next;
+	unsigned id;
+	int state;          /* One of enum job_states */
+	int priority;
+	int status;         /* What the job returned, once it's over */
+	char *desc;         /* What the job is about, for the UI */
+	Clipboard *clip;    /* What to do, NULL once it's been done */
+	char *destpath;
+	dev_t devs[2];      /* Devices the job reads from and writes to */
+	int ndevs;
+	Progress progress;
+	struct timespec start, end; /* Both zero until the job starts */
+} Job;
+
+/* Tunables, set in config.h */
+typedef struct {
+	int runners;        /* Jobs that can run at the same time */
+	int order;          /* One of enum job_orders */
+	int keep;           /* Finished jobs to keep listed */
+	int per_device;     /* Jobs that can use a device at once, 0 for any */
+	int journal;        /* Journal long jobs, so that they can be resumed */
+	int priorities[OP_NR];  /* Priority of new jobs, by operation */
+} Jobopts;
+
+unsigned job_at(int idx);
+int      job_cancel(unsigned id);
+int      job_limit(unsigned id, unsigned long bps, unsigned long ops);
+const char *job_opname(int op);
+int      job_pause(unsigned id);
+int      job_prioritize(unsigned id, int delta);
+unsigned job_resume(Clipboard *clip, char *destpath, Journal *journal);
+unsigned job_submit(Clipboard *clip, char *destpath);
+double   job_throughput(Job *job, int bytes);
+void     jobs_deinit();
+int      jobs_error(char *buf, size_t len);
+void     jobs_init(const Jobopts *opts);
+Job*     jobs_lock();
+void     jobs_unlock();
+
+#endif
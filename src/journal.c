@@ -0,0 +1,323 @@
+#define _GNU_SOURCE     /* flock(), mkostemp() */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "clipboard.h"
+#include "fileops.h"
+#include "journal.h"
+#include "utils.h"
+
+#define JOURNAL_MAGIC "sheriff journal 1"
+#define JOURNAL_PREFIX "job-"
+
+static int      journal_add(Journal *j, const char *name);
+static void     journal_dir_add(Journal *j, const char *path);
+static Journal* journal_new(int fd, const char *path);
+
+/* Let go of a journal. Unless keep is set, it's deleted too: the job is over,
+ * and there's nothing left to resume */
+void
+journal_close(Journal *j, int keep)
+{
+	int i;
+
+	if (!j) {
+		return;
+	}
+	if (!keep) {
+		unlink(j->path);
+	}
+	close(j->fd);
+
+	for (i=0; i<j->count; i++) {
+		free(j->names[i]);
+	}
+	for (i=0; i<j->ndirs; i++) {
+		free(j->dirs[i]);
+	}
+	free(j->names);
+	free(j->dirof);
+	free(j->states);
+	free(j->dirs);
+	free(j->dest);
+	free(j->path);
+	free(j);
+}
+
+/* Find the directory journals go in, $XDG_STATE_HOME/sheriff, and create it
+ * if it isn't there yet. path has to hold PATH_MAX bytes */
+int
+journal_dir(char *path)
+{
+	const char *base;
+	char *slash;
+	int len;
+
+	if ((base = getenv("XDG_STATE_HOME")) && *base) {
+		len = snprintf(path, PATH_MAX, "%s/sheriff", base);
+	} else if ((base = getenv("HOME")) && *base) {
+		len = snprintf(path, PATH_MAX, "%s/.local/state/sheriff", base);
+	} else {
+		return ENOENT;
+	}
+	if (len >= PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	for (slash = path + 1; (slash = strchr(slash, '/')); slash++) {
+		*slash = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			return errno;
+		}
+		*slash = '/';
+	}
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return errno;
+	}
+	return 0;
+}
+
+/* Look for journals left behind by jobs that never finished, storing up to max
+ * of their paths in paths. Returns how many were found */
+int
+journal_find(char **paths, int max)
+{
+	char dirpath[PATH_MAX];
+	struct dirent *ent;
+	char *path;
+	DIR *dir;
+	int fd, count;
+
+	if (journal_dir(dirpath) || !(dir = opendir(dirpath))) {
+		return 0;
+	}
+
+	count = 0;
+	while (count < max && (ent = readdir(dir))) {
+		if (strncmp(ent->d_name, JOURNAL_PREFIX, strlen(JOURNAL_PREFIX))) {
+			continue;
+		}
+		path = join_path(dirpath, ent->d_name);
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0 &&
+		    !flock(fd, LOCK_EX | LOCK_NB)) {
+			paths[count++] = path;
+		} else {
+			free(path);     /* Someone's still on it */
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	closedir(dir);
+
+	return count;
+}
+
+/* Tell the journal that item is being worked on. Returns its state */
+int
+journal_item(Journal *j, int item)
+{
+	if (!j || item < 0 || item >= j->count) {
+		return JOURNAL_TODO;
+	}
+	j->cur = item;
+	return j->states[item];
+}
+
+/* How many items aren't done yet */
+int
+journal_left(const Journal *j)
+{
+	int i, left;
+
+	for (i=0, left=0; j && i<j->count; i++) {
+		left += (j->states[i] != JOURNAL_DONE);
+	}
+	return left;
+}
+
+/* Load a journal left behind, and take it over, to resume its job. Returns NULL
+ * if it's held by someone else, or there's nothing to resume: a journal whose
+ * header never made it to the disk is deleted on the spot */
+Journal *
+journal_load(const char *path)
+{
+	char line[PCT_LINE_LEN];
+	Journal *j;
+	FILE *fp;
+	int fd, item, header, ok;
+
+	if ((fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0 || !(fp = fdopen(dup(fd), "r"))) {
+		close(fd);
+		return NULL;
+	}
+	j = journal_new(fd, path);
+	j->resumed = 1;
+
+	header = 1;
+	ok = (fgets(line, sizeof(line), fp) && !strcmp(line, JOURNAL_MAGIC "\n"));
+	while (ok && fgets(line, sizeof(line), fp)) {
+		/* Only the last line can have been cut short, and it's dropped */
+		if (!strchr(line, '\n')) {
+			break;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		if (!header) {
+			if (sscanf(line + 1, " %d", &item) == 1 && item >= 0 &&
+			    item < j->count) {
+				j->states[item] = JOURNAL_DONE;
+			}
+		} else if (!strcmp(line, "go")) {
+			header = 0;
+		} else if (!strncmp(line, "op   ", 5)) {
+			j->op = atoi(line + 5);
+		} else if (strlen(line) < 5 || pct_decode(line + 5)) {
+			ok = 0;
+		} else if (!strncmp(line, "src  ", 5)) {
+			journal_dir_add(j, line + 5);
+		} else if (!strncmp(line, "dest ", 5)) {
+			free(j->dest);
+			j->dest = safealloc(strlen(line + 5) + 1);
+			strcpy(j->dest, line + 5);
+		} else if (!strncmp(line, "item ", 5)) {
+			ok = !journal_add(j, line + 5);
+		}
+	}
+	fclose(fp);
+
+	if (!ok || header || !j->dest || !j->count) {
+		journal_close(j, 0);
+		return NULL;
+	}
+	return j;
+}
+
+/* Note that the current item is done */
+void
+journal_mark(Journal *j)
+{
+	if (!j) {
+		return;
+	}
+	j->states[j->cur] = JOURNAL_DONE;
+	if (dprintf(j->fd, "d %d\n", j->cur) > 0 &&
+	    fileop_opts()->durability == DURABLE_STRICT) {
+		fdatasync(j->fd);
+	}
+}
+
+/* Start a journal for a job doing op on the items in list, towards dest.
+ * Journals are a nicety: returns NULL if one can't be written */
+Journal *
+journal_open(int op, const struct cliplist *list, const char *dest)
+{
+	char path[PATH_MAX], opstr[16];
+	const Clipgroup *g;
+	Journal *j;
+	FILE *fp;
+	int fd, i, k, err;
+
+	if (!list || journal_dir(path) ||
+	    strlen(path) + strlen("/" JOURNAL_PREFIX "XXXXXX") >= sizeof(path)) {
+		return NULL;
+	}
+	strcat(path, "/" JOURNAL_PREFIX "XXXXXX");
+	if ((fd = mkostemp(path, O_APPEND | O_CLOEXEC)) < 0) {
+		return NULL;
+	}
+	flock(fd, LOCK_EX);
+
+	j = journal_new(fd, path);
+	j->op = op;
+	j->dest = safealloc(strlen(dest) + 1);
+	strcpy(j->dest, dest);
+
+	/* The header can be long, it's buffered. Marks go straight to fd */
+	if (!(fp = fdopen(dup(fd), "a"))) {
+		journal_close(j, 0);
+		return NULL;
+	}
+	sprintf(opstr, "%d", op);
+	err = (fprintf(fp, JOURNAL_MAGIC "\n") < 0 ||
+	       pct_put(fp, "op   ", opstr) || pct_put(fp, "dest ", j->dest));
+	for (i=0; i<list->ngroups && !err; i++) {
+		g = list->groups[i];
+		journal_dir_add(j, g->path);
+		err = pct_put(fp, "src  ", g->path);
+		for (k=0; k<g->count && !err; k++) {
+			err = (journal_add(j, CLIP_NAME(g, k)) ||
+			       pct_put(fp, "item ", CLIP_NAME(g, k)));
+		}
+	}
+	err = (err || fprintf(fp, "go\n") < 0);
+	if (fclose(fp) || err) {
+		journal_close(j, 0);
+		return NULL;
+	}
+	return j;
+}
+
+/* Whether the job was picked up from a journal left behind */
+int
+journal_resumed(const Journal *j)
+{
+	return j && j->resumed;
+}
+
+/* Static functions {{{*/
+/* Append an item to a journal being built, in the last directory added.
+ * Returns -1 if name is too long, or there's no directory yet */
+int
+journal_add(Journal *j, const char *name)
+{
+	int size;
+
+	if (strlen(name) > NAME_MAX || !j->ndirs) {
+		return -1;
+	}
+	/* The arrays double in size, and are full whenever count is a power of 2 */
+	if (!(j->count & (j->count - 1))) {
+		size = (j->count ? j->count * 2 : 1);
+		j->names = saferealloc(j->names, sizeof(*j->names) * size);
+		j->dirof = saferealloc(j->dirof, sizeof(*j->dirof) * size);
+		j->states = saferealloc(j->states, sizeof(*j->states) * size);
+	}
+	j->names[j->count] = safealloc(strlen(name) + 1);
+	strcpy(j->names[j->count], name);
+	j->dirof[j->count] = j->ndirs - 1;
+	j->states[j->count++] = JOURNAL_TODO;
+	return 0;
+}
+
+/* Add a directory to a journal being built, for the items that follow */
+void
+journal_dir_add(Journal *j, const char *path)
+{
+	j->dirs = saferealloc(j->dirs, sizeof(*j->dirs) * (j->ndirs + 1));
+	j->dirs[j->ndirs] = safealloc(strlen(path) + 1);
+	strcpy(j->dirs[j->ndirs++], path);
+}
+
+/* An empty journal, on fd */
+Journal *
+journal_new(int fd, const char *path)
+{
+	Journal *j;
+
+	j = safealloc(sizeof(*j));
+	memset(j, '\0', sizeof(*j));
+	j->fd = fd;
+	j->path = safealloc(strlen(path) + 1);
+	strcpy(j->path, path);
+	return j;
+}
+/*}}}*/
@@ -0,0 +1,51 @@
+/**
+ * Journals of the jobs that take a while, so that they can be picked up where
+ * they were left if sheriff goes away halfway through them. A journal is an
+ * append-only file: a header saying what the job is about, i.e. the operation,
+ * the paths and the items in the clipboard, each after the directory it's in,
+ * followed by a short line for every item dealt with.
+ * Journals live in $XDG_STATE_HOME/sheriff, locked by whoever's running their
+ * job: the ones nobody holds were left behind, and can be resumed. A resumed
+ * job skips what its journal says is done, and syncs rather than copies what
+ * might have been copied in part.
+ * All the functions taking a Journal are fine with a NULL one, which is what
+ * jobs that aren't journaled have.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+struct cliplist;
+
+/* Where an item of a journaled job is at */
+enum journal_states {
+	JOURNAL_TODO,
+	JOURNAL_DONE
+};
+
+typedef struct journal {
+	int fd;
+	char *path;
+	int op;             /* One of enum clip_ops */
+	char **dirs;        /* Directories the items are in */
+	int ndirs;
+	char *dest;         /* Destination path, as the job has it */
+	char **names;       /* Items, in clipboard order */
+	int *dirof;         /* Index in dirs of the directory of each item */
+	unsigned char *states;  /* One of enum journal_states, by item */
+	int count;
+	int cur;            /* Item being worked on */
+	int resumed;        /* Picked up after an earlier run */
+} Journal;
+
+void     journal_close(Journal *j, int keep);
+int      journal_dir(char *path);
+int      journal_find(char **paths, int max);
+int      journal_item(Journal *j, int item);
+int      journal_left(const Journal *j);
+Journal* journal_load(const char *path);
+void     journal_mark(Journal *j);
+Journal* journal_open(int op, const struct cliplist *list, const char *dest);
+int      journal_resumed(const Journal *j);
+
+#endif
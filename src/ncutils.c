@@ -32,7 +32,7 @@ dialog(WINDOW *win, char *input, const char *msg, ...)
 
 		curs_set(0);                    /* Go back to default */
 		noecho();
-		wtimeout(win, UPD_INTERVAL);
+		wtimeout(win, KEY_TIMEOUT);
 	}
 }
 
@@ -11,7 +11,7 @@
 #include "backend.h"
 
 #define MAXCMDLEN 128
-#define UPD_INTERVAL 30
+#define KEY_TIMEOUT 0   /* Keys are waited for with poll(), not by wgetch() */
 
 /* Convenient enum to address a specific view in main_view */
 enum windows {
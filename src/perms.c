@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "perms.h"
+
+#define PERMS_BUFSIZE 4096  /* For getpwnam_r() and getgrnam_r() */
+#define PERMS_NAMELEN 256
+
+static int perms_id(const char *name, size_t len, int group, unsigned *id);
+static int perms_mode(struct perm_clause *clauses, int *count,
+                      const char *str, size_t len);
+
+/* The mode a node with mode should be given. Only the permission bits change */
+mode_t
+perms_apply(const Perms *p, mode_t mode)
+{
+	const struct perm_clause *c;
+	mode_t bits, perm;
+	int dir, i;
+
+	dir = S_ISDIR(mode) ? 1 : 0;
+	perm = mode & 07777;
+	for (i=0; i<p->count[dir]; i++) {
+		c = p->clauses[dir] + i;
+		bits = c->bits;
+		if (c->cond_exec && (dir || perm & 0111)) {
+			bits |= 0111;
+		}
+		bits &= c->who;
+
+		switch (c->op) {
+		case '+':
+			perm |= bits;
+			break;
+		case '-':
+			perm &= ~bits;
+			break;
+		default:
+			perm = (perm & ~c->who) | bits;
+			break;
+		}
+	}
+
+	return (mode & ~07777) | perm;
+}
+
+/* Parse a spec made of a mode and/or an owner, separated by spaces, into p.
+ * Returns EINVAL if it doesn't make sense, ENOENT if there's no such user or
+ * group */
+int
+perms_parse(Perms *p, const char *spec)
+{
+	const char *tok, *colon, *slash;
+	unsigned id;
+	size_t len;
+	int err, seen;
+
+	memset(p, '\0', sizeof(*p));
+	p->uid = (uid_t)-1;
+	p->gid = (gid_t)-1;
+
+	seen = 0;
+	for (tok = spec; *tok; tok += len) {
+		if (*tok == ' ') {
+			len = 1;
+			continue;
+		}
+		len = strcspn(tok, " ");
+		seen = 1;
+
+		/* user:group, either of which can be left out */
+		if ((colon = memchr(tok, ':', len))) {
+			if (colon > tok) {
+				if ((err = perms_id(tok, colon - tok, 0, &id))) {
+					return err;
+				}
+				p->uid = id;
+			}
+			if (colon + 1 < tok + len) {
+				if ((err = perms_id(colon + 1, tok + len - colon - 1, 1, &id))) {
+					return err;
+				}
+				p->gid = id;
+			}
+			continue;
+		}
+
+		/* A mode for files, and one for directories if it's different */
+		if (p->count[0]) {
+			return EINVAL;
+		}
+		if ((slash = memchr(tok, '/', len))) {
+			if ((err = perms_mode(p->clauses[0], p->count, tok, slash - tok)) ||
+			    (err = perms_mode(p->clauses[1], p->count + 1, slash + 1,
+			                      tok + len - slash - 1))) {
+				return err;
+			}
+		} else {
+			if ((err = perms_mode(p->clauses[0], p->count, tok, len))) {
+				return err;
+			}
+			memcpy(p->clauses[1], p->clauses[0], sizeof(p->clauses[0]));
+			p->count[1] = p->count[0];
+		}
+	}
+
+	return seen ? 0 : EINVAL;
+}
+
+/* Static functions {{{*/
+/* Look up a user, or a group, by name or number */
+int
+perms_id(const char *name, size_t len, int group, unsigned *id)
+{
+	char str[PERMS_NAMELEN], buf[PERMS_BUFSIZE], *end;
+	struct passwd pw, *pwp;
+	struct group gr, *grp;
+
+	if (len >= sizeof(str)) {
+		return ENOENT;
+	}
+	memcpy(str, name, len);
+	str[len] = '\0';
+
+	*id = strtoul(str, &end, 10);
+	if (!*end) {
+		return 0;
+	}
+	if (group) {
+		if (getgrnam_r(str, &gr, buf, sizeof(buf), &grp) || !grp) {
+			return ENOENT;
+		}
+		*id = grp->gr_gid;
+	} else {
+		if (getpwnam_r(str, &pw, buf, sizeof(buf), &pwp) || !pwp) {
+			return ENOENT;
+		}
+		*id = pwp->pw_uid;
+	}
+	return 0;
+}
+
+/* Parse a mode, octal or symbolic, into count clauses */
+int
+perms_mode(struct perm_clause *clauses, int *count, const char *str,
+           size_t len)
+{
+	const char *end, *s;
+	struct perm_clause *c;
+	mode_t who, octal;
+
+	end = str + len;
+	if (!len) {
+		return EINVAL;
+	}
+
+	/* Octal modes set everything */
+	if (len <= 4 && strspn(str, "01234567") >= len) {
+		for (octal = 0, s = str; s < end; s++) {
+			octal = (octal << 3) + (*s - '0');
+		}
+		clauses->who = 07777;
+		clauses->bits = octal;
+		clauses->op = '=';
+		clauses->cond_exec = 0;
+		*count = 1;
+		return 0;
+	}
+
+	for (s = str; s < end; s++) {
+		for (who = 0; s < end && strchr("ugoa", *s); s++) {
+			who |= (*s == 'u' ? S_IRWXU | S_ISUID :
+			        *s == 'g' ? S_IRWXG | S_ISGID :
+			        *s == 'o' ? S_IRWXO | S_ISVTX : 07777);
+		}
+		if (!who) {
+			who = 07777;
+		}
+		if (s == end || !strchr("+-=", *s)) {
+			return EINVAL;
+		}
+
+		/* Each operator makes a clause: u+r-w is u+r,u-w */
+		while (s < end && *s && strchr("+-=", *s)) {
+			if (*count >= PERMS_MAXCLAUSES) {
+				return EINVAL;
+			}
+			c = clauses + (*count)++;
+			c->who = who;
+			c->bits = 0;
+			c->op = *s++;
+			c->cond_exec = 0;
+			for (; s < end && *s && strchr("rwxXst", *s); s++) {
+				switch (*s) {
+				case 'r': c->bits |= 0444; break;
+				case 'w': c->bits |= 0222; break;
+				case 'x': c->bits |= 0111; break;
+				case 'X': c->cond_exec = 1; break;
+				case 's': c->bits |= S_ISUID | S_ISGID; break;
+				default: c->bits |= S_ISVTX; break;
+				}
+			}
+		}
+		if (s < end && *s != ',') {
+			return EINVAL;
+		}
+		if (s + 1 == end) {     /* Trailing comma */
+			return EINVAL;
+		}
+	}
+
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,36 @@
+/**
+ * Permission and ownership changes, written the way chmod and chown take them:
+ * octal or symbolic modes (u+rwX,go-w), optionally followed by a different one
+ * for directories (644/755), and an owner and/or a group (user:group, user:,
+ * :group). Symbolic modes that don't say who they're for are for everyone,
+ * regardless of the umask. A spec is parsed once for the whole job into a
+ * Perms struct, which then gives the mode each node should end up with, given
+ * the one it has, so that nodes that are already right can be left alone.
+ */
+
+#ifndef PERMS_H
+#define PERMS_H
+
+#include <sys/types.h>
+
+#define PERMS_MAXCLAUSES 16
+
+/* One operation of a symbolic mode, e.g. the "g-w" in "u+rwX,g-w" */
+struct perm_clause {
+	mode_t who;         /* Bits the clause can touch, from [ugoa] */
+	mode_t bits;        /* Bits it adds, removes, or sets */
+	char op;            /* '+', '-' or '=' */
+	char cond_exec;     /* X: execute, only for dirs and executables */
+};
+
+typedef struct {
+	struct perm_clause clauses[2][PERMS_MAXCLAUSES];    /* Files, dirs */
+	int count[2];
+	uid_t uid;          /* (uid_t)-1 to leave them alone */
+	gid_t gid;
+} Perms;
+
+mode_t perms_apply(const Perms *p, mode_t mode);
+int    perms_parse(Perms *p, const char *spec);
+
+#endif
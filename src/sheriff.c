@@ -1,25 +1,44 @@
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <locale.h>
 #include <ncurses.h>
-#include <semaphore.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "backend.h"
 #include "clipboard.h"
 #include "dir.h"
 #include "fileops.h"
+#include "jobs.h"
+#include "journal.h"
 #include "ncutils.h"
+#include "perms.h"
 #include "sheriff.h"
 #include "tabs.h"
+#include "trash.h"
 #include "ui.h"
+#include "undo.h"
 #include "utils.h"
 
 #define MAXSEARCHLEN MAXCMDLEN
+#define UPDATE_MAXPATHS 16      /* Changed dirs to track before rescanning all */
+#define UPDATE_DIRS_MS 250      /* Least time between two rescans */
+#define UPDATE_STATUS_MS 100    /* Least time between two status bar redraws */
+#define JOBS_REDRAW_MS 500      /* How often the jobs view is redrawn */
+#define MAXRESUME 16            /* Unfinished jobs offered to resume at once */
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | \
+                      IN_MOVE_SELF | IN_ONLYDIR)
 
 typedef union {
 	int i;
@@ -36,17 +55,35 @@ static int   abs_tabswitch(int idx);
 static int   direct_cd(char *center_path);
 static int   enter_directory();
 static int   exit_directory();
+static long  ms_since(const struct timespec *then, const struct timespec *now);
+static int   next_key(int reap, int timeout);
+static void  rescan_changed(char **paths, int npaths);
 static void  resize_handler();
-static void  update_reaper();
+static void  resume_jobs();
+static int   trash_cur(int *err);
+static void  update_poke(int old);
+static int   update_reaper();
+static void  watches_read();
+static void  watches_sync();
 static void  xdg_open(Direntry *file);
 
 /* Functions that can be used in config.h */
 static void  abs_highlight(const Arg *arg);
 static void  chain(const Arg *arg);
 static void  chmod_cur(const Arg *arg);
+static void  chmod_submit(char *spec);
+static void  chown_cur(const Arg *arg);
 static void  clear_sel(const Arg *arg);
 static void  delete_cur(const Arg *arg);
 static void  filesearch(const Arg *arg);
+static void  goto_trash(const Arg *arg);
+static void  job_cancel_cur(const Arg *arg);
+static void  job_highlight(const Arg *arg);
+static void  job_limit_cur(const Arg *arg);
+static void  job_pause_cur(const Arg *arg);
+static void  job_prioritize_cur(const Arg *arg);
+static void  jobs_close(const Arg *arg);
+static void  jobs_view(const Arg *arg);
 static void  link_cur(const Arg *arg);
 static void  makedir(const Arg *arg);
 static void  navigate(const Arg *arg);
@@ -56,16 +93,37 @@ static void  refresh_all(const Arg *arg);
 static void  rel_highlight(const Arg *arg);
 static void  rel_tabswitch(const Arg *arg);
 static void  rename_cur(const Arg *arg);
+static void  restore_cur(const Arg *arg);
+static void  sync_cur(const Arg *arg);
 static void  tab_clone(const Arg *arg);
 static void  tab_delete(const Arg *arg);
 static void  toggle_hidden(const Arg *arg);
 static void  touch(const Arg *arg);
+static void  undo_cur(const Arg *arg);
 static void  visualmode_toggle(const Arg *arg);
+static void  yank_add(const Arg *arg);
 static void  yank_cur(const Arg *arg);
 
 static Dirview m_view[WIN_NR];
 static int cur_tab = 0;
-static sem_t m_update_sem;
+static int m_jobs_open;             /* The jobs view is being shown */
+static int m_job_sel;               /* Job highlighted in the jobs view */
+
+/* Updates queued by the workers, merged by type */
+static struct {
+	int types;          /* Bitmask of 1 << enum update_types */
+	char *paths[UPDATE_MAXPATHS];   /* Directories that changed */
+	int npaths;         /* -1 when there were too many to keep track of */
+	pthread_mutex_t mutex;  /* Guards the paths, and setting UPDATE_DIRS */
+} m_updates = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static int m_update_fd = -1;        /* eventfd poked when updates get queued */
+
+/* Directories shown in the panes, watched for changes made by others */
+static int m_inotify_fd = -1;
+static struct {
+	int wd;
+	char *path;
+} m_watches[WIN_NR];
 
 /* Keybind handlers {{{*/
 /* Select an element in the center view by absolute index */
@@ -143,10 +201,9 @@ chain(const Arg *arg)
 	int i;
 	Key *binds = arg->v;
 
-	wtimeout(m_view[BOT].win, -1);
 	do {
 		/* Handle resize events while waiting for input */
-		ch = wgetch(m_view[BOT].win);
+		ch = next_key(1, -1);
 		if (ch == KEY_RESIZE) {
 			resize_handler();
 		} else if (ch != KEY_EXIT) {
@@ -158,20 +215,52 @@ chain(const Arg *arg)
 			}
 		}
 	} while (ch == KEY_RESIZE);
-	wtimeout(m_view[BOT].win, UPD_INTERVAL);
 }
 
+/* Change the mode of the selected files, e.g. to 644, u+rwX or 644/755. An
+ * owner can be thrown in too, see perms.h */
 void
 chmod_cur(const Arg *arg)
 {
 	char modestr[MAXCMDLEN+1];  /* Oversized, I know... */
 	dialog(m_view[BOT].win, modestr, "chmod: ");
 
-	if (modestr[0] != '\0') {
-		clip_update(m_view[CENTER].ctx->dir, OP_CHMOD);
-		m_view[CENTER].ctx->visual = 0;
-		clip_exec(modestr);
+	chmod_submit(modestr);
+}
+
+/* Check a chmod spec, and start a job applying it to the selected files */
+void
+chmod_submit(char *spec)
+{
+	Perms perms;
+	int err;
+
+	if (spec[0] == '\0') {
+		return;
+	}
+	if ((err = perms_parse(&perms, spec))) {
+		dialog(m_view[BOT].win, NULL, "Can't chmod to %s: %s", spec,
+		       strerror(err));
+		return;
+	}
+	clip_update(m_view[CENTER].ctx->dir, OP_CHMOD);
+	m_view[CENTER].ctx->visual = 0;
+	clip_exec(spec);
+}
+
+/* Change the owner of the selected files, to user, user:group or :group */
+void
+chown_cur(const Arg *arg)
+{
+	char owner[MAXCMDLEN+1];
+	dialog(m_view[BOT].win, owner, "chown: ");
+
+	/* A plain name is a user, but chmod specs tell owners by their colon */
+	if (owner[0] != '\0' && !strchr(owner, ':') &&
+	    strlen(owner) < sizeof(owner) - 1) {
+		strcat(owner, ":");
 	}
+	chmod_submit(owner);
 }
 
 
@@ -183,12 +272,26 @@ clear_sel(const Arg *arg)
 	render_tree(m_view + CENTER, 1);
 }
 
+/* Delete the selected files, to the trash if there's one to put them in. From
+ * the trash itself, they're deleted for good, and so are the files that can't
+ * be renamed into it, e.g. mount points */
 void
 delete_cur(const Arg *arg)
 {
 	char ans[MAXCMDLEN+1];
-	dialog(m_view[BOT].win, ans,
-	       "Are you sure you want to delete all the selected files? (yes/no) ");
+	int failed, err;
+
+	failed = (fileop_opts()->trash ? trash_cur(&err) : -1);
+	if (!failed) {
+		return;
+	} else if (failed > 0) {
+		dialog(m_view[BOT].win, ans,
+		       "Couldn't trash %d files (%s), delete them for good? (yes/no) ",
+		       failed, strerror(err));
+	} else {
+		dialog(m_view[BOT].win, ans,
+		       "Are you sure you want to delete all the selected files? (yes/no) ");
+	}
 
 	if ((ans[0] & 0xDF) == 'Y') {
 		dialog(m_view[BOT].win, NULL, "Deleting...");
@@ -233,9 +336,131 @@ filesearch(const Arg *arg)
 	}
 }
 
+/* Go to the trash of the filesystem we're on */
+void
+goto_trash(const Arg *arg)
+{
+	char trash[PATH_MAX];
+	char *files;
+	int err;
+
+	if ((err = trash_find(m_view[CENTER].ctx->dir->path, trash))) {
+		dialog(m_view[BOT].win, NULL, "No trash here: %s", strerror(err));
+		return;
+	}
+
+	files = join_path(trash, "files");
+	direct_cd(files);
+	free(files);
+}
+
+/* Cancel the job highlighted in the jobs view */
+void
+job_cancel_cur(const Arg *arg)
+{
+	job_cancel(job_at(m_job_sel));
+}
+
+/* Move the highlight in the jobs view by arg->i jobs */
+void
+job_highlight(const Arg *arg)
+{
+	m_job_sel += arg->i;
+	if (m_job_sel < 0) {
+		m_job_sel = 0;
+	}
+}
+
+/* Limit how fast the job highlighted in the jobs view goes, or all of the jobs
+ * together if arg->i is set. Sizes are read as tohuman() writes them, and an
+ * empty limit, or 0, means no limit */
+void
+job_limit_cur(const Arg *arg)
+{
+	char ans[MAXCMDLEN+1], bpsstr[MAXCMDLEN+1], opsstr[MAXCMDLEN+1];
+	unsigned long bps, ops;
+	int n;
+
+	dialog(m_view[BOT].win, ans, "Limit %s to (bytes/s [files/s]): ",
+	       arg->i ? "all jobs" : "job");
+	if ((n = sscanf(ans, "%s %s", bpsstr, opsstr)) < 1) {
+		return;
+	}
+
+	ops = 0;
+	if (fromhuman(bpsstr, &bps) || (n > 1 && fromhuman(opsstr, &ops))) {
+		dialog(m_view[BOT].win, NULL, "Invalid limit: %s", ans);
+		return;
+	}
+
+	if (arg->i) {
+		throttle_set(bps, ops);
+	} else {
+		job_limit(job_at(m_job_sel), bps, ops);
+	}
+}
+
+/* Pause or resume the job highlighted in the jobs view */
+void
+job_pause_cur(const Arg *arg)
+{
+	job_pause(job_at(m_job_sel));
+}
+
+/* Raise or lower the priority of the job highlighted in the jobs view */
+void
+job_prioritize_cur(const Arg *arg)
+{
+	job_prioritize(job_at(m_job_sel), arg->i);
+}
+
+/* Leave the jobs view */
+void
+jobs_close(const Arg *arg)
+{
+	m_jobs_open = 0;
+}
+
+/* Show the jobs in place of the center pane, handling the keys in arg->v until
+ * one of them calls jobs_close(). The list is redrawn every JOBS_REDRAW_MS, so
+ * that the progress of the running jobs is kept up to date */
+void
+jobs_view(const Arg *arg)
+{
+	wchar_t ch;
+	int i, count;
+	Key *binds = arg->v;
+
+	m_jobs_open = 1;
+	while (m_jobs_open) {
+		count = render_jobs(m_view + CENTER, m_job_sel);
+		if (m_job_sel >= count && count > 0) {
+			m_job_sel = count - 1;
+			render_jobs(m_view + CENTER, m_job_sel);
+		}
+		update_status_bottom(m_view + BOT);
+
+		/* Updates would redraw the panes, they're left for later */
+		ch = next_key(0, JOBS_REDRAW_MS);
+		if (ch == KEY_RESIZE) {
+			resize_handler();
+		} else if (ch != ERR) {
+			for (i=0; binds[i].key != '\0'; i++) {
+				if (ch == binds[i].key) {
+					binds[i].funct(&binds[i].arg);
+					break;
+				}
+			}
+		}
+	}
+
+	render_tree(m_view + CENTER, 1);
+}
+
 void
 link_cur(const Arg *arg)
 {
+	clip_pull();
 	clip_change_op(OP_LINK);
 	paste_cur(NULL);
 }
@@ -310,6 +535,7 @@ paste_cur(const Arg *arg)
 {
 	Direntry *dir = m_view[CENTER].ctx->dir;
 
+	clip_pull();    /* Another instance may have yanked since */
 	clip_exec(dir->path);
 	m_view[CENTER].ctx->visual = 0;
 }
@@ -333,7 +559,7 @@ quick_cd(const Arg *arg)
 void
 refresh_all(const Arg *arg)
 {
-	queue_master_update();
+	queue_master_update(UPDATE_ALL, NULL);
 }
 
 /* Highlight a file in the center window given an offset from the currently
@@ -385,12 +611,51 @@ rename_cur(const Arg *arg)
 	}
 }
 
+/* Put the selected files in the trash back where they came from */
+void
+restore_cur(const Arg *arg)
+{
+	Direntry *dir, *sel;
+	char *path;
+	int i, err;
+
+	dir = m_view[CENTER].ctx->dir;
+	sel = NULL;
+	snapshot_tree_selected(&sel, dir);
+	for (i=0; sel && i<sel->count; i++) {
+		path = join_path(sel->path, sel->tree[i]->name);
+		if ((err = trash_restore(path))) {
+			dialog(m_view[BOT].win, NULL, "Couldn't restore %s: %s",
+			       sel->tree[i]->name, strerror(err));
+		}
+		free(path);
+	}
+	if (sel) {
+		free_listing(&sel);
+	}
+
+	clear_dir_selection(dir);
+	m_view[CENTER].ctx->visual = 0;
+	rescan_pane(m_view[CENTER].ctx);
+	render_tree(m_view + CENTER, 1);
+}
+
+/* Paste the clipboard, skipping the files that are already up to date in the
+ * current directory */
+void
+sync_cur(const Arg *arg)
+{
+	clip_pull();
+	clip_change_op(OP_SYNC);
+	paste_cur(NULL);
+}
+
 /* Toggle hidden files visibility, and queue a full screen redraw */
 void
 toggle_hidden(const Arg *arg)
 {
 	dir_toggle_hidden();
-	queue_master_update();
+	queue_master_update(UPDATE_ALL, NULL);
 }
 
 void
@@ -407,6 +672,18 @@ touch(const Arg *arg)
 	render_tree(m_view + CENTER, 1);
 }
 
+/* Take back the latest move, rename or trashing, by any instance */
+void
+undo_cur(const Arg *arg)
+{
+	int err;
+
+	if ((err = clip_undo())) {
+		dialog(m_view[BOT].win, NULL, "Nothing to undo%s%s",
+		       err == ENOENT ? "" : ": ", err == ENOENT ? "" : strerror(err));
+	}
+}
+
 /* Toggle visual selection mode */
 void
 visualmode_toggle(const Arg *arg)
@@ -418,11 +695,29 @@ visualmode_toggle(const Arg *arg)
 	render_tree(m_view + CENTER, 1);
 }
 
+/* Add the current selection to what the clipboard holds already, so that files
+ * from several directories can be pasted at once */
+void
+yank_add(const Arg *arg)
+{
+	int count;
+
+	clip_pull();    /* Add to what was yanked last, wherever it was */
+	count = clip_add(m_view[CENTER].ctx->dir, (arg->i == 1 ? OP_COPY : OP_MOVE));
+	clip_publish();
+	clear_dir_selection(m_view[CENTER].ctx->dir);
+	m_view[CENTER].ctx->visual = 0;
+
+	dialog(m_view[BOT].win, NULL, "Selection added, %d files yanked", count);
+	render_tree(m_view + CENTER, 1);
+}
+
 /* Yank the current selection to clipboard */
 void
 yank_cur(const Arg *arg)
 {
 	clip_update(m_view[CENTER].ctx->dir, (arg->i == 1 ? OP_COPY : OP_MOVE));
+	clip_publish();
 	clear_dir_selection(m_view[CENTER].ctx->dir);
 	m_view[CENTER].ctx->visual = 0;
 
@@ -524,15 +819,148 @@ exit_directory()
 	return status;
 }
 
-/* Signal the updater that it has something to do on the next check */
+/* Milliseconds from then to now */
+long
+ms_since(const struct timespec *then, const struct timespec *now)
+{
+	return (now->tv_sec - then->tv_sec) * 1000 +
+	       (now->tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/* Wait for a key and return it, while taking care of what comes in meanwhile:
+ * worker updates and directory changes reported by inotify. They're handled
+ * right away if reap is set, or just queued otherwise. If timeout is positive,
+ * give up and return ERR after that many ms. Nothing runs while there's
+ * nothing to do: the wait is a poll() on stdin, the update eventfd and inotify,
+ * timed to wake up for the updates that still have to wait for their turn */
+int
+next_key(int reap, int timeout)
+{
+	struct pollfd fds[3];
+	struct timespec start, now;
+	uint64_t count;
+	long left;
+	int ch, wait;
+
+	fds[0].fd = STDIN_FILENO;
+	fds[1].fd = m_update_fd;
+	fds[2].fd = m_inotify_fd;
+	fds[0].events = fds[1].events = fds[2].events = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (;;) {
+		/* ncurses might be holding keys already read from stdin, and knows
+		 * when the terminal's been resized */
+		if ((ch = wgetch(m_view[BOT].win)) != ERR) {
+			return ch;
+		}
+
+		wait = -1;
+		if (reap) {
+			wait = update_reaper();
+			watches_sync();
+		}
+		if (timeout >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if ((left = timeout - ms_since(&start, &now)) <= 0) {
+				return ERR;
+			}
+			if (wait < 0 || left < wait) {
+				wait = left;
+			}
+		}
+
+		/* SIGWINCH interrupts the wait, and gets turned into KEY_RESIZE */
+		if (poll(fds, 3, wait) < 0 && errno != EINTR) {
+			return ERR;
+		}
+		if (fds[1].revents & POLLIN && read(m_update_fd, &count, sizeof(count))) {
+			;   /* Just clearing it, the updates are in m_updates */
+		}
+		if (fds[2].revents & POLLIN) {
+			watches_read();
+		}
+	}
+}
+
+/* Tell the updater it has something to do on the next check. Progress updates
+ * don't take any lock, since they're the most frequent ones by far. The main
+ * loop only needs waking up if nothing was queued already: if something was,
+ * it's either being handled, or the loop is waiting for its turn to come */
 void
-queue_master_update()
+queue_master_update(int type, const char *path)
 {
-	int sem_val;
+	int i, old;
 
-	sem_getvalue(&m_update_sem, &sem_val);
-	if (sem_val < 1) {
-		sem_post(&m_update_sem);
+	if (type != UPDATE_DIRS) {
+		old = __atomic_fetch_or(&m_updates.types, 1 << type, __ATOMIC_RELEASE);
+		update_poke(old);
+		return;
+	}
+
+	pthread_mutex_lock(&m_updates.mutex);
+	for (i=0; path && i<m_updates.npaths; i++) {
+		if (!strcmp(m_updates.paths[i], path)) {
+			break;
+		}
+	}
+	if (!path || m_updates.npaths == UPDATE_MAXPATHS) {
+		for (i=0; i<m_updates.npaths; i++) {
+			free(m_updates.paths[i]);
+		}
+		m_updates.npaths = -1;
+	} else if (m_updates.npaths >= 0 && i == m_updates.npaths) {
+		m_updates.paths[m_updates.npaths] = safealloc(strlen(path) + 1);
+		strcpy(m_updates.paths[m_updates.npaths++], path);
+	}
+	old = __atomic_fetch_or(&m_updates.types, 1 << UPDATE_DIRS,
+	                        __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&m_updates.mutex);
+	update_poke(old);
+}
+
+/* Rescan the panes showing any of the npaths directories in paths, or all of
+ * them if npaths is negative, and redraw them. The paths are freed */
+void
+rescan_changed(char **paths, int npaths)
+{
+	const Direntry *dir;
+	Fileentry *centersel;
+	char *path;
+	int changed[WIN_NR];
+	int i, v;
+
+	for (v=0; v<WIN_NR; v++) {
+		changed[v] = (npaths < 0);
+	}
+	for (i=0; i<npaths; i++) {
+		for (v=LEFT; v<=RIGHT; v++) {
+			dir = m_view[v].ctx->dir;
+			changed[v] |= (dir && dir->path && !strcmp(dir->path, paths[i]));
+		}
+		free(paths[i]);
+	}
+
+	if (changed[LEFT]) {
+		rescan_pane(m_view[LEFT].ctx);
+		render_tree(m_view + LEFT, 0);
+	}
+	if (changed[CENTER]) {
+		rescan_pane(m_view[CENTER].ctx);
+		render_tree(m_view + CENTER, 1);
+	}
+
+	/* What the right pane shows depends on the center selection */
+	if (changed[CENTER] || changed[RIGHT]) {
+		centersel = m_view[CENTER].ctx->dir->tree[m_view[CENTER].ctx->dir->sel_idx];
+		if (S_ISDIR(centersel->mode)) {
+			path = join_path(m_view[CENTER].ctx->dir->path, centersel->name);
+			init_pane_with_path(m_view[RIGHT].ctx, path);
+			free(path);
+		} else {
+			init_pane_with_path(m_view[RIGHT].ctx, NULL);
+		}
+		render_tree(m_view + RIGHT, 0);
 	}
 }
 
@@ -584,29 +1012,240 @@ resize_handler()
 	update_status_bottom(m_view + BOT);
 }
 
-/* The core updater function, it gets called periodically and checks whether a
- * worker has done something in the background that requires a screen update */
+/* Offer to resume the jobs an earlier run left unfinished, one at a time */
 void
-update_reaper()
+resume_jobs()
+{
+	char ans[MAXCMDLEN+1];
+	char *paths[MAXRESUME];
+	Journal *journal;
+	int i, n;
+
+	n = journal_find(paths, MAXRESUME);
+	for (i=0; i<n; i++) {
+		if ((journal = journal_load(paths[i]))) {
+			dialog(m_view[BOT].win, ans,
+			       "Resume the unfinished %s of %s%s (%d of %d left)? (yes/no) ",
+			       job_opname(journal->op), journal->dirs[0],
+			       journal->ndirs > 1 ? " and more" : "",
+			       journal_left(journal), journal->count);
+			if ((ans[0] & 0xDF) == 'Y') {
+				clip_resume(journal);
+			} else {
+				journal_close(journal, 0);
+			}
+		}
+		free(paths[i]);
+	}
+}
+
+/* Move the selected files to the trash, which takes a rename each, and have the
+ * trash purged in the background if that's what it takes to keep it within its
+ * limits. The files that couldn't be trashed are left selected, with why the
+ * last one couldn't in err. Returns -1 if none of them can be trashed, e.g.
+ * since they're in the trash already, how many couldn't otherwise */
+int
+trash_cur(int *err)
 {
+	char trash[PATH_MAX], trashed[PATH_MAX];
+	Direntry *dir, *sel;
 	char *path;
-	Fileentry *centersel;
+	Undo *undo;
+	int i, idx, failed, e;
 
-	if (!sem_trywait(&m_update_sem)) {
-		rescan_pane(m_view[LEFT].ctx);
-		rescan_pane(m_view[CENTER].ctx);
-		centersel = m_view[CENTER].ctx->dir->tree[m_view[CENTER].ctx->dir->sel_idx];
-		if (S_ISDIR(centersel->mode)) {
-			path = join_path(m_view[CENTER].ctx->dir->path, centersel->name);
-			init_pane_with_path(m_view[RIGHT].ctx, path);
-			free(path);
+	dir = m_view[CENTER].ctx->dir;
+	if (trash_find(dir->path, trash) || trash_holds(trash, dir->path)) {
+		return -1;
+	}
+
+	sel = NULL;
+	failed = 0;
+	undo = undo_new(OP_DELETE);
+	snapshot_tree_selected(&sel, dir);
+	for (i=0; sel && i<sel->count; i++) {
+		path = join_path(sel->path, sel->tree[i]->name);
+		if ((e = trash_file(trash, path, trashed))) {
+			*err = e;
+			failed++;
 		} else {
-			init_pane_with_path(m_view[RIGHT].ctx, NULL);
+			undo_add(undo, path, trashed);
+			sel->tree[i]->selected = 0;
 		}
-		render_tree(m_view + LEFT, 0);
-		render_tree(m_view + CENTER, 1);
-		render_tree(m_view + RIGHT, 0);
+		free(path);
+	}
+	undo_commit(undo);
+
+	clear_dir_selection(dir);
+	m_view[CENTER].ctx->visual = 0;
+	rescan_pane(m_view[CENTER].ctx);
+
+	/* What's still there is what's left to delete */
+	dir = m_view[CENTER].ctx->dir;
+	for (i=0; failed && i<sel->count; i++) {
+		if (sel->tree[i]->selected &&
+		    (idx = exact_file_idx(dir, sel->tree[i]->name)) >= 0) {
+			dir->tree[idx]->selected = 1;
+			dir->sel_idx = idx;
+		}
+	}
+	if (sel) {
+		free_listing(&sel);
+	}
+	render_tree(m_view + CENTER, 1);
+
+	if (fileop_opts()->trash_size || fileop_opts()->trash_days) {
+		clip_purge(trash);
+	}
+	return failed;
+}
+
+/* Wake the main loop up, unless updates were queued already (old being the
+ * mask of them) */
+void
+update_poke(int old)
+{
+	uint64_t one = 1;
+
+	if (!old && m_update_fd >= 0 && write(m_update_fd, &one, sizeof(one))) {
+		;   /* It can only fail if the counter is full, it's awake then */
+	}
+}
+
+/* The core updater function, it gets called from the main loop and checks
+ * whether a worker has done something in the background that requires a
+ * screen update. Only what the queued updates call for is redone, and no more
+ * often than UPDATE_*_MS, so that a job going through lots of files can't keep
+ * the main thread busy rescanning. Returns how many ms to wait before the
+ * updates still queued are due, -1 if there are none */
+int
+update_reaper()
+{
+	static struct timespec last_dirs, last_status;
+	char *paths[UPDATE_MAXPATHS];
+	char error[PROGRESS_ERRLEN];
+	struct timespec now;
+	int types, npaths, wait, w;
+
+	if (!(types = __atomic_load_n(&m_updates.types, __ATOMIC_ACQUIRE))) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (types & (1 << UPDATE_ALL) || (types & (1 << UPDATE_DIRS) &&
+	    ms_since(&last_dirs, &now) >= UPDATE_DIRS_MS)) {
+		pthread_mutex_lock(&m_updates.mutex);
+		npaths = (types & (1 << UPDATE_ALL) ? -1 : m_updates.npaths);
+		memcpy(paths, m_updates.paths, sizeof(paths));
+		if (npaths < 0) {
+			for (; m_updates.npaths > 0; m_updates.npaths--) {
+				free(m_updates.paths[m_updates.npaths - 1]);
+			}
+		}
+		m_updates.npaths = 0;
+		__atomic_fetch_and(&m_updates.types,
+		                   ~(1 << UPDATE_ALL | 1 << UPDATE_DIRS), __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&m_updates.mutex);
+
+		rescan_changed(paths, npaths);
+		last_dirs = now;
+		types |= 1 << UPDATE_STATUS;
+	}
+
+	if (types & (1 << UPDATE_STATUS) &&
+	    (ms_since(&last_status, &now) >= UPDATE_STATUS_MS ||
+	     types & (1 << UPDATE_ALL))) {
+		__atomic_fetch_and(&m_updates.types, ~(1 << UPDATE_STATUS),
+		                   __ATOMIC_RELAXED);
 		update_status_bottom(m_view + BOT);
+		last_status = now;
+
+		/* Workers can't draw, they leave their errors for us to show */
+		if (jobs_error(error, sizeof(error))) {
+			dialog(m_view[BOT].win, NULL, "%s", error);
+			wrefresh(m_view[BOT].win);
+		}
+	}
+
+	/* Whatever's left has to wait for its turn */
+	types = __atomic_load_n(&m_updates.types, __ATOMIC_ACQUIRE);
+	wait = (types & (1 << UPDATE_ALL) ? 0 : -1);
+	if (types & (1 << UPDATE_DIRS)) {
+		w = UPDATE_DIRS_MS - ms_since(&last_dirs, &now);
+		wait = (w > 0 ? w : 0);
+	}
+	if (types & (1 << UPDATE_STATUS)) {
+		w = UPDATE_STATUS_MS - ms_since(&last_status, &now);
+		w = (w > 0 ? w : 0);
+		wait = (wait < 0 || w < wait ? w : wait);
+	}
+
+	return wait;
+}
+
+/* Queue a rescan of the directories inotify says have changed */
+void
+watches_read()
+{
+	union {
+		struct inotify_event ev;    /* Just for the alignment */
+		char buf[4096];
+	} u;
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int v;
+
+	while ((len = read(m_inotify_fd, u.buf, sizeof(u.buf))) > 0) {
+		for (p = u.buf; p < u.buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event*)p;
+			for (v=LEFT; v<=RIGHT; v++) {
+				if (m_watches[v].wd != ev->wd) {
+					continue;
+				}
+				queue_master_update(UPDATE_DIRS, m_watches[v].path);
+				/* The directory is gone, and so is the watch */
+				if (ev->mask & IN_IGNORED) {
+					m_watches[v].wd = -1;
+				}
+			}
+		}
+	}
+}
+
+/* Keep inotify watching the directories shown in the panes, and only them */
+void
+watches_sync()
+{
+	const Direntry *dir;
+	const char *path;
+	int v, w, shared;
+
+	for (v=LEFT; v<=RIGHT && m_inotify_fd >= 0; v++) {
+		dir = m_view[v].ctx->dir;
+		path = (dir && dir->path ? dir->path : NULL);
+		if (m_watches[v].path && path ? !strcmp(m_watches[v].path, path) :
+		    m_watches[v].path == path) {
+			continue;
+		}
+
+		/* Two panes showing the same directory share the watch */
+		if (m_watches[v].wd >= 0) {
+			for (w=LEFT, shared=0; w<=RIGHT; w++) {
+				shared |= (w != v && m_watches[w].wd == m_watches[v].wd);
+			}
+			if (!shared) {
+				inotify_rm_watch(m_inotify_fd, m_watches[v].wd);
+			}
+		}
+		free(m_watches[v].path);
+		m_watches[v].path = NULL;
+		m_watches[v].wd = -1;
+
+		if (path) {
+			m_watches[v].wd = inotify_add_watch(m_inotify_fd, path, WATCH_EVENTS);
+			m_watches[v].path = safealloc(strlen(path) + 1);
+			strcpy(m_watches[v].path, path);
+		}
 	}
 }
 
@@ -689,12 +1328,12 @@ int
 main(int argc, char *argv[])
 {
 	int i, max_row, max_col;
+	char trash[PATH_MAX];
 	char *path;
 	wchar_t ch;
 
 	setlocale(LC_ALL, "");                 /* Enable unicode goodness */
-	clip_init();                           /* Initialize clipboard */
-	sem_init(&m_update_sem, 0, 0);         /* Initialize the update semaphore */
+	clip_init(shared_clipboard);           /* Initialize clipboard */
 
 	/* Initialize ncurses */
 	initscr();                             /* Initialize ncurses screen */
@@ -710,14 +1349,28 @@ main(int argc, char *argv[])
 	keypad(m_view[BOT].win, TRUE);
 
 	/* Initialize windows with the current path */
-	fileops_init();
+	fileops_init(&fileopts);
+	jobs_init(&jobopts);
+	/* Get the home trash within its limits, in case it's grown past them */
+	if (fileopts.trash && (fileopts.trash_size || fileopts.trash_days) &&
+	    getenv("HOME") && !trash_find(getenv("HOME"), trash)) {
+		clip_purge(trash);
+	}
 	path = realpath(".", NULL);
 	tabctx_append(path);
 	free(path);
 
 	abs_tabswitch(0);
+	if (jobopts.journal) {
+		resume_jobs();
+	}
 	/* Main control loop */
-	while ((ch = wgetch(m_view[BOT].win)) != 'q') {
+	m_update_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	for (i=0; i<WIN_NR; i++) {
+		m_watches[i].wd = -1;
+	}
+	while ((ch = next_key(1, -1)) != 'q') {
 		/* Call the function associated with the key pressed */
 		switch (ch) {
 		case KEY_RESIZE:
@@ -734,13 +1387,19 @@ main(int argc, char *argv[])
 			}
 			break;
 		}
-		update_reaper();
 	}
 
 	/* Terminate ncurses session */
-	sem_destroy(&m_update_sem);
 	windows_deinit(m_view);
-	fileops_deinit();
+	jobs_deinit();
+	for (i=0; i<m_updates.npaths; i++) {
+		free(m_updates.paths[i]);
+	}
+	for (i=0; i<WIN_NR; i++) {
+		free(m_watches[i].path);
+	}
+	close(m_inotify_fd);
+	close(m_update_fd);
 	tabctx_deinit();
 	clip_deinit();
 	endwin();
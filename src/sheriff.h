@@ -2,17 +2,23 @@
  * Definitions required for inter-process communication live here. Other than
  * that, sheriff.c is the main source file, so it doesn't really have to export
  * any function names. As a result, most of the stuff is declared static.
+ * Workers ask the main thread to update the screen with queue_master_update():
+ * path is the directory that changed for UPDATE_DIRS (NULL for all of them),
+ * and is ignored otherwise.
  */
 
 #ifndef SHERIFF_H
 #define SHERIFF_H
 
+/* What a worker wants the main thread to redraw. Updates of the same type are
+ * merged until the main thread gets to them, and it gets to each type at most
+ * so often, however many are queued in the meantime */
 enum update_types {
-	UPDATE_DIRS,
-	UPDATE_STATUS,
-	UPDATE_ALL
+	UPDATE_DIRS,        /* The contents of a directory have changed */
+	UPDATE_STATUS,      /* Progress or errors to show in the bottom bar */
+	UPDATE_ALL          /* Rescan and redraw everything, right away */
 };
 
-void queue_master_update();
+void queue_master_update(int type, const char *path);
 
 #endif
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE     /* renameat2() */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "fileops.h"
+#include "trash.h"
+#include "utils.h"
+
+#define INFO_EXT ".trashinfo"
+#define DATE_FMT "%Y-%m-%dT%H:%M:%S"
+#define MAX_SUFFIX 1000     /* Give up on a name after this many clashes */
+
+/* A file in the trash, as trash_purge() sees it */
+typedef struct {
+	char name[NAME_MAX+1];
+	time_t deleted;
+	off_t size;
+} Trashed;
+
+static int  trash_cmp(const void *a, const void *b);
+static int  trash_info(const char *trash, const char *name, char *origpath,
+                       time_t *deleted);
+static int  trash_mkdirs(const char *trash);
+static void trash_top(const char *trash, char *top);
+static int  trash_topdir(const char *path, dev_t dev, char *top);
+
+/* Put path in the trash, which has to be on its same filesystem, as returned
+ * by trash_find(), storing where it ended up in trashed (PATH_MAX bytes) unless
+ * it's NULL. Returns 0 on success, an errno value otherwise */
+int
+trash_file(const char *trash, const char *path, char *trashed)
+{
+	char name[NAME_MAX+1], info[PATH_MAX], dest[PATH_MAX], top[PATH_MAX];
+	char date[32], origpath[PATH_MAX*3];
+	const char *fname, *rel;
+	time_t now;
+	int fd, i, err;
+
+	/* Paths are relative to the top directory, in a trash that has one */
+	trash_top(trash, top);
+	rel = path;
+	if (*top && !strncmp(path, top, strlen(top)) && path[strlen(top)] == '/') {
+		rel = path + strlen(top) + 1;
+	}
+	if (pct_encode(rel, origpath, sizeof(origpath))) {
+		return ENAMETOOLONG;
+	}
+
+	now = time(NULL);
+	strftime(date, sizeof(date), DATE_FMT, localtime(&now));
+	fname = extract_filename(path);
+	fname = (fname ? fname : path);
+
+	/* The .trashinfo file is created first, and exclusively, which is how
+	 * trashed names are reserved */
+	for (i=0; i<MAX_SUFFIX; i++) {
+		if (i == 0) {
+			snprintf(name, sizeof(name), "%s", fname);
+		} else {
+			snprintf(name, sizeof(name), "%s.%d", fname, i);
+		}
+		snprintf(info, sizeof(info), "%s/info/%s" INFO_EXT, trash, name);
+		snprintf(dest, sizeof(dest), "%s/files/%s", trash, name);
+
+		if ((fd = open(info, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+			if (errno == EEXIST) {
+				continue;
+			}
+			return errno;
+		}
+		err = (dprintf(fd, "[Trash Info]\nPath=%s\nDeletionDate=%s\n",
+		               origpath, date) < 0 ? errno : 0);
+		close(fd);
+
+		/* A file might be left there without its .trashinfo */
+		if (!err && renameat2(AT_FDCWD, path, AT_FDCWD, dest,
+		                      RENAME_NOREPLACE) < 0) {
+			err = errno;
+		}
+		if (err) {
+			unlink(info);
+		} else if (trashed) {
+			strcpy(trashed, dest);
+		}
+		if (err != EEXIST) {
+			return err;
+		}
+	}
+
+	return EEXIST;
+}
+
+/* Find the trash for path, the one on its same filesystem, creating it if it
+ * doesn't exist yet. trash has to hold PATH_MAX bytes. Returns 0 on success,
+ * an errno value otherwise */
+int
+trash_find(const char *path, char *trash)
+{
+	struct stat st, tst;
+	char top[PATH_MAX];
+	const char *data;
+	size_t len;
+	int err;
+
+	if (stat(path, &st) < 0) {
+		return errno;
+	}
+
+	/* The home trash, if we're on the home filesystem */
+	len = PATH_MAX;
+	if ((data = getenv("XDG_DATA_HOME")) && *data) {
+		len = snprintf(trash, PATH_MAX, "%s/Trash", data);
+	} else if ((data = getenv("HOME")) && *data) {
+		len = snprintf(trash, PATH_MAX, "%s/.local/share/Trash", data);
+	}
+	if (len < PATH_MAX && !trash_mkdirs(trash) && !stat(trash, &tst) &&
+	    tst.st_dev == st.st_dev) {
+		return 0;
+	}
+
+	/* Otherwise, the one at the top of the filesystem. An admin-provided
+	 * .Trash has to be sticky, and not a symlink */
+	if ((err = trash_topdir(path, st.st_dev, top))) {
+		return err;
+	}
+	if (!strcmp(top, "/")) {
+		*top = '\0';
+	}
+	if (snprintf(trash, PATH_MAX, "%s/.Trash/%u", top,
+	             (unsigned)getuid()) >= PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+	*strrchr(trash, '/') = '\0';
+	if (!lstat(trash, &tst) && S_ISDIR(tst.st_mode) &&
+	    tst.st_mode & S_ISVTX) {
+		trash[strlen(trash)] = '/';
+		if (!trash_mkdirs(trash)) {
+			return 0;
+		}
+	}
+	sprintf(trash, "%s/.Trash-%u", top, (unsigned)getuid());
+
+	return trash_mkdirs(trash);
+}
+
+/* Whether path is trash itself, or something in it */
+int
+trash_holds(const char *trash, const char *path)
+{
+	size_t len;
+
+	len = strlen(trash);
+	return !strncmp(path, trash, len) && (path[len] == '/' || !path[len]);
+}
+
+/* Delete files from trash, the ones trashed first first, until what's left is
+ * within the size and age limits in Fileopts. Meant to run as a job, reporting
+ * to pr. Returns 0 on success, an errno value otherwise */
+int
+trash_purge(const char *trash, Progress *pr)
+{
+	const Fileopts *opts;
+	struct dirent *ent;
+	Trashed *items;
+	char info[PATH_MAX];
+	char *path;
+	size_t len;
+	off_t total;
+	time_t now;
+	int i, count, size, err, status;
+	DIR *dir;
+
+	opts = fileop_opts();
+	snprintf(info, sizeof(info), "%s/info", trash);
+	if (!(dir = opendir(info))) {
+		return errno;
+	}
+
+	/* Find out what's in there, how old, and how big */
+	items = NULL;
+	count = size = 0;
+	total = 0;
+	while ((ent = readdir(dir)) && !progress_check(pr)) {
+		len = strlen(ent->d_name);
+		if (len <= strlen(INFO_EXT) || len - strlen(INFO_EXT) > NAME_MAX ||
+		    strcmp(ent->d_name + len - strlen(INFO_EXT), INFO_EXT)) {
+			continue;
+		}
+		if (count >= size) {
+			size = (size ? size * 2 : 64);
+			items = saferealloc(items, sizeof(*items) * size);
+		}
+		memcpy(items[count].name, ent->d_name, len - strlen(INFO_EXT));
+		items[count].name[len - strlen(INFO_EXT)] = '\0';
+		if (trash_info(trash, items[count].name, NULL,
+		               &items[count].deleted)) {
+			continue;
+		}
+
+		/* A purge cut short can leave a .trashinfo without its file */
+		path = safealloc(strlen(trash) + strlen(items[count].name) + 8);
+		sprintf(path, "%s/files/%s", trash, items[count].name);
+		if (access(path, F_OK) < 0 && errno == ENOENT) {
+			snprintf(info, sizeof(info), "%s/info/%s", trash, ent->d_name);
+			unlink(info);
+		} else {
+			items[count].size = tree_size(path);
+			total += items[count].size;
+			count++;
+		}
+		free(path);
+	}
+	closedir(dir);
+
+	qsort(items, count, sizeof(*items), trash_cmp);
+	now = time(NULL);
+	status = 0;
+	for (i=0; i<count && !progress_check(pr); i++) {
+		if ((!opts->trash_days ||
+		     now - items[i].deleted < opts->trash_days * 86400L) &&
+		    (!opts->trash_size || total <= opts->trash_size)) {
+			break;
+		}
+
+		/* The file goes first, so that it can't be left without its
+		 * .trashinfo and never be purged again */
+		path = safealloc(strlen(trash) + strlen(items[i].name) + 8);
+		sprintf(path, "%s/files/%s", trash, items[i].name);
+		if (!(err = delete_file(path, pr))) {
+			snprintf(info, sizeof(info), "%s/info/%s" INFO_EXT, trash,
+			         items[i].name);
+			unlink(info);
+			total -= items[i].size;
+		}
+		status |= err;
+		free(path);
+	}
+
+	free(items);
+	return status;
+}
+
+/* Put a trashed file back where it came from. path is where it is in the
+ * trash, i.e. $trash/files/name. Returns 0 on success, an errno value
+ * otherwise: EEXIST if something has taken its place in the meantime */
+int
+trash_restore(const char *path)
+{
+	char trash[PATH_MAX], origpath[PATH_MAX], info[PATH_MAX];
+	char *name;
+
+	if (strlen(path) >= sizeof(trash)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(trash, path);
+	if (!(name = strrchr(trash, '/')) || name - trash < 6 ||
+	    strncmp(name - 6, "/files", 6)) {
+		return EINVAL;
+	}
+	*name++ = '\0';
+	name[-7] = '\0';
+
+	if (trash_info(trash, name, origpath, NULL)) {
+		return EINVAL;
+	}
+	if (snprintf(info, sizeof(info), "%s/info/%s" INFO_EXT, trash, name) >=
+	    sizeof(info)) {
+		return ENAMETOOLONG;
+	}
+	if (renameat2(AT_FDCWD, path, AT_FDCWD, origpath, RENAME_NOREPLACE) < 0) {
+		return errno;
+	}
+
+	unlink(info);
+	return 0;
+}
+
+/* Static functions {{{*/
+/* Sort trashed files by deletion date */
+int
+trash_cmp(const void *a, const void *b)
+{
+	const Trashed *x = a, *y = b;
+
+	return (x->deleted > y->deleted) - (x->deleted < y->deleted);
+}
+
+/* Read the .trashinfo file of a trashed file, getting its original path
+ * (absolute, and decoded) and when it was trashed. Either can be NULL */
+int
+trash_info(const char *trash, const char *name, char *origpath,
+           time_t *deleted)
+{
+	char line[PATH_MAX*3+16], path[PATH_MAX], top[PATH_MAX];
+	struct tm tm;
+	size_t len;
+	int found;
+	FILE *fp;
+
+	snprintf(line, sizeof(line), "%s/info/%s" INFO_EXT, trash, name);
+	if (!(fp = fopen(line, "r"))) {
+		return errno;
+	}
+
+	found = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!strncmp(line, "Path=", 5) && !pct_decode(line + 5)) {
+			trash_top(trash, top);
+			if (line[5] != '/') {
+				len = snprintf(path, sizeof(path), "%s/%s", top, line + 5);
+			} else {
+				len = snprintf(path, sizeof(path), "%s", line + 5);
+			}
+			if (len < sizeof(path)) {
+				found |= 1;
+			}
+		} else if (!strncmp(line, "DeletionDate=", 13)) {
+			memset(&tm, '\0', sizeof(tm));
+			if (strptime(line + 13, DATE_FMT, &tm)) {
+				tm.tm_isdst = -1;
+				if (deleted) {
+					*deleted = mktime(&tm);
+				}
+				found |= 2;
+			}
+		}
+	}
+	fclose(fp);
+
+	if (found != 3) {
+		return EINVAL;
+	}
+	if (origpath) {
+		strcpy(origpath, path);
+	}
+	return 0;
+}
+
+/* Make sure trash and the directories in it exist, along with its parents */
+int
+trash_mkdirs(const char *trash)
+{
+	char path[PATH_MAX];
+	char *slash;
+
+	if (strlen(trash) + strlen("/files") >= sizeof(path)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(path, trash);
+	for (slash = path + 1; (slash = strchr(slash, '/')); slash++) {
+		*slash = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+			return errno;
+		}
+		*slash = '/';
+	}
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return errno;
+	}
+
+	strcat(path, "/files");
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return errno;
+	}
+	strcpy(path + strlen(trash), "/info");
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return errno;
+	}
+	return 0;
+}
+
+/* The top directory of a trash, that the paths in it are relative to, empty
+ * for the home trash which has absolute paths */
+void
+trash_top(const char *trash, char *top)
+{
+	const char *base;
+	char *slash;
+
+	snprintf(top, PATH_MAX, "%s", trash);
+	if (!(slash = strrchr(top, '/'))) {
+		*top = '\0';
+		return;
+	}
+	base = slash + 1;
+
+	if (!strncmp(base, ".Trash-", 7)) {             /* $topdir/.Trash-$uid */
+		*slash = '\0';
+	} else if (slash - top >= 7 && !strncmp(slash - 7, "/.Trash", 7)) {
+		slash[-7] = '\0';                           /* $topdir/.Trash/$uid */
+	} else {
+		*top = '\0';
+	}
+}
+
+/* Find the top directory of the filesystem path is on, dev, i.e. where it's
+ * mounted. top has to hold PATH_MAX bytes */
+int
+trash_topdir(const char *path, dev_t dev, char *top)
+{
+	struct stat st;
+	char *slash;
+
+	if (!realpath(path, top)) {
+		return errno;
+	}
+
+	while ((slash = strrchr(top, '/'))) {
+		if (slash == top) {
+			if (!stat("/", &st) && st.st_dev == dev) {
+				top[1] = '\0';
+			}
+			return 0;
+		}
+		*slash = '\0';
+		if (stat(top, &st) < 0 || st.st_dev != dev) {
+			*slash = '/';
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+/*}}}*/
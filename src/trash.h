@@ -0,0 +1,25 @@
+/**
+ * The trash, laid out the way the freedesktop.org spec wants it, so that other
+ * file managers can see and restore what's in it. Files are put in the trash
+ * on their own filesystem, which makes trashing them a rename no matter how big
+ * they are: $XDG_DATA_HOME/Trash on the home filesystem, $topdir/.Trash/$uid or
+ * $topdir/.Trash-$uid on the others. Next to every trashed file is a .trashinfo
+ * file telling where it came from and when it was deleted, which is what
+ * restoring it goes by.
+ * Actually freeing the space is left to trash_purge(), which is meant to run
+ * as a job in the background, and keeps each trash within the limits set in
+ * Fileopts by deleting the files trashed first.
+ */
+
+#ifndef TRASH_H
+#define TRASH_H
+
+#include "fileops.h"
+
+int trash_file(const char *trash, const char *path, char *trashed);
+int trash_find(const char *path, char *trash);
+int trash_holds(const char *trash, const char *path);
+int trash_purge(const char *trash, Progress *pr);
+int trash_restore(const char *path);
+
+#endif
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include "backend.h"
 #include "fileops.h"
+#include "jobs.h"
 #include "ncutils.h"
 #include "ui.h"
 #include "utils.h"
@@ -16,6 +17,63 @@ check_offset_changed(Dirview *win)
 	return recheck_offset(win->ctx, getmaxy(win->win));
 }
 
+/* Render the job list on a window, highlighting the selth job. Returns the
+ * number of jobs listed */
+int
+render_jobs(Dirview *win, int sel)
+{
+	static const char *states[] = {
+		[JOB_QUEUED] = "queued",
+		[JOB_RUNNING] = "running",
+		[JOB_DONE] = "done",
+		[JOB_FAILED] = "failed",
+		[JOB_CANCELLED] = "cancelled",
+	};
+	char rate[HUMANSIZE_LEN+1];
+	const char *state;
+	char *line;
+	Progstat st;
+	Job *job;
+	int i, mr, mc, percent, paused;
+
+	getmaxyx(win->win, mr, mc);
+	werase(win->win);
+	line = safealloc(sizeof(*line) * (mc + 1));
+
+	for (job = jobs_lock(), i = 0; job && i < mr; job = job->next, i++) {
+		progress_read(&job->progress, &st);
+		percent = (st.obj_count > 0 ? 100 * st.obj_done / st.obj_count : 0);
+		paused = (st.control == PROGRESS_PAUSE);
+
+		state = (paused && job->state <= JOB_RUNNING ? "paused" :
+		         states[job->state]);
+		tohuman(job_throughput(job, 1), rate);
+
+		/* Counts are refined as we go, done can briefly get ahead */
+		snprintf(line, mc + 1, "%3u %-9s %3d%% %6s/s %6.0f obj/s  %s", job->id,
+		         state, percent > 100 ? 100 : percent, rate,
+		         job_throughput(job, 0), job->desc);
+
+		wattrset(win->win, COLOR_PAIR(job->state == JOB_FAILED ?
+		                              PAIR_RED_DEF : PAIR_WHITE_DEF));
+		mvwprintw(win->win, i, 0, "%s", line);
+		if (i == sel) {
+			mvwchgat(win->win, i, 0, -1, A_REVERSE, job->state == JOB_FAILED ?
+			         PAIR_RED_DEF : PAIR_WHITE_DEF, NULL);
+		}
+	}
+	jobs_unlock();
+
+	if (i == 0) {
+		wattrset(win->win, COLOR_PAIR(PAIR_WHITE_DEF));
+		mvwprintw(win->win, 0, 0, "No jobs");
+	}
+
+	free(line);
+	wrefresh(win->win);
+	return i;
+}
+
 /* Render a directory listing on a window. If the directoly listing is NULL,
  * clear the relative window */
 int
@@ -155,15 +213,20 @@ update_status_bottom(Dirview *win)
 {
 	char last_mod[MAXDATELEN+1];
 	char mode[10+1];
+	char holes[HUMANSIZE_LEN+1];
+	char skipped[HUMANSIZE_LEN+1];
+	char rate[HUMANSIZE_LEN+1], limit[HUMANSIZE_LEN+1];
+	unsigned long max_bps, max_ops;
+	double bps;
 	struct tm *mtime;
 	const Fileentry *sel;
-	Progress *pr;
-	int barlen;
+	Progstat st;
+	Job *job;
+	int barlen, others, shown;
 
 	sel = win->ctx->dir->tree[win->ctx->dir->sel_idx];
 
 	/* Gather some info */
-	pr = fileop_progress();
 	mtime = localtime(&sel->lastchange);
 	strftime(last_mod, MAXDATELEN, "%F %R", mtime);
 	octal_to_str(sel->mode, mode);
@@ -175,15 +238,62 @@ update_status_bottom(Dirview *win)
 	wattrset(win->win, COLOR_PAIR(PAIR_WHITE_DEF));
 	wprintw(win->win," %d  %d  %s", sel->uid, sel->gid, last_mod);
 
-	pthread_mutex_lock(&pr->mutex);
-	if (pr->obj_count > 0) {
-		wprintw(win->win, " %s", pr->fname);
-		barlen = (pr->obj_done / (float)pr->obj_count) * getmaxx(win->win);
+	/* Show how the oldest running job is doing, and how many more there are */
+	st.obj_count = 0;
+	for (job = jobs_lock(), shown = 0, others = 0, bps = 0; job;
+	     job = job->next) {
+		if (job->state == JOB_RUNNING) {
+			bps += job_throughput(job, 1);
+		}
+		if (job->state == JOB_RUNNING && !shown) {
+			progress_read(&job->progress, &st);
+			shown = 1;
+		} else if (job->state <= JOB_RUNNING) {
+			others++;
+		}
+	}
+	jobs_unlock();
+
+	if (st.obj_count > 0) {
+		if (st.control == PROGRESS_PAUSE) {
+			wprintw(win->win, " (paused)");
+		}
+		wprintw(win->win, " %s", st.fname);
+		if (st.holes > 0) {
+			tohuman(st.holes, holes);
+			wprintw(win->win, " (%s of holes skipped)", holes);
+		}
+		if (st.skipped > 0) {
+			tohuman(st.skipped_bytes, skipped);
+			wprintw(win->win, " (%u up to date, %s skipped)", st.skipped,
+			        skipped);
+		}
+		if (st.mismatches > 0) {
+			wprintw(win->win, " (%u copies corrupted)", st.mismatches);
+		}
+		if (others > 0) {
+			wprintw(win->win, " (+%d jobs)", others);
+		}
+		/* How fast all the jobs are going, against how fast they may */
+		tohuman(bps, rate);
+		wprintw(win->win, " %s/s", rate);
+		throttle_get(&max_bps, &max_ops);
+		if (max_bps > 0) {
+			tohuman(max_bps, limit);
+			wprintw(win->win, " (max %s/s)", limit);
+		}
+		if (max_ops > 0) {
+			wprintw(win->win, " (max %lu files/s)", max_ops);
+		}
+		barlen = (st.obj_done / (float)st.obj_count) * getmaxx(win->win);
+		/* Counts are refined as we go, done can briefly get ahead */
+		if (barlen > getmaxx(win->win)) {
+			barlen = getmaxx(win->win);
+		}
 		wmove(win->win, 0, 0);
 		wattrset(win->win, A_REVERSE);
 		wchgat(win->win, barlen, A_REVERSE, PAIR_GREEN_DEF, NULL);
 	}
-	pthread_mutex_unlock(&pr->mutex);
 
 	wrefresh(win->win);
 }
@@ -298,7 +408,7 @@ windows_init(Dirview view[WIN_NR], int row, int col, int pp[3])
 	view[CENTER].win = newwin(row - 2, mc - 1, 1, sc_l);
 	view[RIGHT].win = newwin(row - 2, sc_r, 1, sc_l + mc);
 
-	/* Check for window updates every 250 ms */
-	wtimeout(view[BOT].win, UPD_INTERVAL);
+	/* Input is waited for elsewhere, along with the updates from workers */
+	wtimeout(view[BOT].win, KEY_TIMEOUT);
 	return 0;
 }
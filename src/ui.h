@@ -23,6 +23,7 @@ typedef struct {
 } Dirview;
 
 int  check_offset_changed(Dirview *view);
+int  render_jobs(Dirview *win, int sel);
 int  render_tree(Dirview *win, int show_sizes);
 int  tab_switch(Dirview view[WIN_NR], const TabCtx *ctx);
 int  try_highlight(Dirview *view, int idx);
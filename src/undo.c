@@ -0,0 +1,363 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "clipboard.h"
+#include "fileops.h"
+#include "journal.h"
+#include "sheriff.h"
+#include "trash.h"
+#include "undo.h"
+#include "utils.h"
+
+#define UNDO_MAGIC "sheriff undo 1"
+
+static int   undo_cmp(const void *a, const void *b);
+static int   undo_dir(char *path);
+static void  undo_free(Undo *u);
+static Undo* undo_load(const char *path, int max, int *total);
+static void  undo_prune(const char *dirpath);
+
+/* Note that the file at from went to to */
+void
+undo_add(Undo *u, const char *from, const char *to)
+{
+	int size;
+
+	if (!u) {
+		return;
+	}
+	if (!(u->count & (u->count - 1))) {
+		size = (u->count ? u->count * 2 : 1);
+		u->from = saferealloc(u->from, sizeof(*u->from) * size);
+		u->to = saferealloc(u->to, sizeof(*u->to) * size);
+	}
+	u->from[u->count] = safealloc(strlen(from) + 1);
+	strcpy(u->from[u->count], from);
+	u->to[u->count] = safealloc(strlen(to) + 1);
+	strcpy(u->to[u->count++], to);
+}
+
+/* Take the latest batch out of the log, for undo_run(), storing where it's
+ * been put in path (PATH_MAX bytes). Returns ENOENT if there's none, and if
+ * another instance has claimed it first */
+int
+undo_claim(char *path)
+{
+	char dirpath[PATH_MAX], src[PATH_MAX], latest[NAME_MAX+1];
+	struct dirent *ent;
+	DIR *dir;
+	int err;
+
+	if ((err = undo_dir(dirpath))) {
+		return err;
+	}
+	if (!(dir = opendir(dirpath))) {
+		return errno;
+	}
+	/* Batches being written, or undone, are hidden */
+	*latest = '\0';
+	while ((ent = readdir(dir))) {
+		if (*ent->d_name != '.' && strcmp(ent->d_name, latest) > 0) {
+			strcpy(latest, ent->d_name);
+		}
+	}
+	closedir(dir);
+	if (!*latest) {
+		return ENOENT;
+	}
+
+	if (snprintf(src, sizeof(src), "%s/%s", dirpath, latest) >=
+	    (int)sizeof(src) ||
+	    snprintf(path, PATH_MAX, "%s/.%s", dirpath, latest) >= PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+	if (rename(src, path) < 0) {
+		return errno;
+	}
+	return 0;
+}
+
+/* Write a batch out to the log, and let go of it. The log is a nicety: if the
+ * batch can't be written, it's dropped */
+void
+undo_commit(Undo *u)
+{
+	char dirpath[PATH_MAX], tmp[PATH_MAX], path[PATH_MAX];
+	struct timespec now;
+	FILE *fp;
+	int fd, i, err;
+
+	if (!u) {
+		return;
+	}
+	if (!u->count || !fileop_opts()->undo || undo_dir(dirpath) ||
+	    snprintf(tmp, sizeof(tmp), "%s/.new-XXXXXX", dirpath) >=
+	    (int)sizeof(tmp) || (fd = mkstemp(tmp)) < 0) {
+		undo_free(u);
+		return;
+	}
+	if (!(fp = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		undo_free(u);
+		return;
+	}
+
+	err = (fprintf(fp, UNDO_MAGIC "\nop   %d\ncount %d\n", u->op,
+	               u->count) < 0);
+	for (i=0; i<u->count && !err; i++) {
+		err = (pct_put(fp, "from ", u->from[i]) ||
+		       pct_put(fp, "to   ", u->to[i]));
+	}
+	err = (err || fflush(fp) || (fileop_opts()->durability ==
+	       DURABLE_STRICT && fdatasync(fd) < 0));
+
+	/* The latest batch sorts last */
+	clock_gettime(CLOCK_REALTIME, &now);
+	err = (fclose(fp) || err ||
+	       snprintf(path, sizeof(path), "%s/%011lld.%09ld-%d", dirpath,
+	                (long long)now.tv_sec, now.tv_nsec, (int)getpid()) >=
+	       (int)sizeof(path) || rename(tmp, path) < 0);
+	if (err) {
+		unlink(tmp);
+	} else {
+		undo_prune(dirpath);
+	}
+	undo_free(u);
+}
+
+/* Summarize the batch claimed at path, e.g. "move foo (+2)", into desc */
+void
+undo_describe(const char *path, char *desc, size_t size)
+{
+	const char *name;
+	Undo *u;
+	int total;
+
+	if (!(u = undo_load(path, 1, &total)) || !u->count) {
+		snprintf(desc, size, "nothing");
+		undo_free(u);
+		return;
+	}
+	name = extract_filename(u->from[0]);
+	name = (name ? name : u->from[0]);
+	if (u->op == OP_DELETE) {
+		snprintf(desc, size, "trash %s", name);
+	} else {
+		snprintf(desc, size, "move %s", name);
+	}
+	if (total > 1 && strlen(desc) + 16 < size) {
+		sprintf(desc + strlen(desc), " (+%d)", total - 1);
+	}
+	undo_free(u);
+}
+
+/* An empty batch, for op */
+Undo *
+undo_new(int op)
+{
+	Undo *u;
+
+	u = safealloc(sizeof(*u));
+	memset(u, '\0', sizeof(*u));
+	u->op = op;
+	return u;
+}
+
+/* Put back what the batch claimed at path moved, the last files moved first,
+ * and drop the batch. Whatever has taken a file's place since is left alone.
+ * If the job is cancelled, what's left to undo goes back in the log */
+int
+undo_run(const char *path, Progress *pr)
+{
+	struct stat st;
+	Undo *u, *left;
+	int i, k, err, status;
+
+	u = undo_load(path, -1, NULL);
+	unlink(path);
+	if (!u) {
+		progress_error(pr, "The undo log is broken");
+		return EINVAL;
+	}
+
+	status = 0;
+	for (i=u->count-1; i>=0; i--) {
+		if (progress_check(pr)) {
+			break;
+		}
+		if (!lstat(u->from[i], &st)) {
+			err = EEXIST;
+		} else if (u->op == OP_DELETE) {
+			if (!(err = trash_restore(u->to[i]))) {
+				progress_add(pr, 1, 1, NULL);
+			}
+		} else {
+			err = move_file(u->to[i], u->from[i], pr);
+		}
+		if (err) {
+			progress_error(pr, "Couldn't put back %s: %s", u->from[i],
+			               strerror(err));
+		}
+		status |= err;
+	}
+
+	/* In the order they were moved, like any other batch */
+	if (i >= 0) {
+		left = undo_new(u->op);
+		for (k=0; k<=i; k++) {
+			undo_add(left, u->from[k], u->to[k]);
+		}
+		undo_commit(left);
+	}
+	/* Moves say which directories changed themselves */
+	if (u->op == OP_DELETE) {
+		queue_master_update(UPDATE_DIRS, NULL);
+	}
+	undo_free(u);
+	return status;
+}
+
+/* Static functions {{{*/
+/* Sort batches by name, which is when they were written */
+int
+undo_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Find the directory the log is in, creating it if it isn't there yet */
+int
+undo_dir(char *path)
+{
+	int err;
+
+	if ((err = journal_dir(path))) {
+		return err;
+	}
+	if (strlen(path) + strlen("/undo") >= PATH_MAX) {
+		return ENAMETOOLONG;
+	}
+	strcat(path, "/undo");
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		return errno;
+	}
+	return 0;
+}
+
+/* Let go of a batch */
+void
+undo_free(Undo *u)
+{
+	int i;
+
+	if (!u) {
+		return;
+	}
+	for (i=0; i<u->count; i++) {
+		free(u->from[i]);
+		free(u->to[i]);
+	}
+	free(u->from);
+	free(u->to);
+	free(u);
+}
+
+/* Read the batch at path, up to max of its files if max isn't negative,
+ * storing how many it has in all in total unless it's NULL. Returns NULL if it
+ * isn't a batch */
+Undo *
+undo_load(const char *path, int max, int *total)
+{
+	char line[PCT_LINE_LEN], from[PCT_LINE_LEN];
+	Undo *u;
+	FILE *fp;
+	int ok;
+
+	if (!(fp = fopen(path, "r"))) {
+		return NULL;
+	}
+	u = undo_new(0);
+	if (total) {
+		*total = 0;
+	}
+
+	*from = '\0';
+	ok = (fgets(line, sizeof(line), fp) && !strcmp(line, UNDO_MAGIC "\n"));
+	while (ok && (max < 0 || u->count < max) &&
+	       fgets(line, sizeof(line), fp)) {
+		if (!strchr(line, '\n')) {
+			ok = 0;
+			break;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		if (!strncmp(line, "op   ", 5)) {
+			u->op = atoi(line + 5);
+		} else if (!strncmp(line, "count ", 6)) {
+			if (total) {
+				*total = atoi(line + 6);
+			}
+		} else if (strlen(line) < 5 || pct_decode(line + 5)) {
+			ok = 0;
+		} else if (!strncmp(line, "from ", 5)) {
+			strcpy(from, line + 5);
+		} else if (!strncmp(line, "to   ", 5) && *from) {
+			undo_add(u, from, line + 5);
+			*from = '\0';
+		} else {
+			ok = 0;
+		}
+	}
+	fclose(fp);
+
+	if (!ok || (u->op != OP_MOVE && u->op != OP_DELETE)) {
+		undo_free(u);
+		return NULL;
+	}
+	return u;
+}
+
+/* Delete the oldest batches, so that only Fileopts.undo are left */
+void
+undo_prune(const char *dirpath)
+{
+	char **names, *path;
+	struct dirent *ent;
+	DIR *dir;
+	int i, count, size;
+
+	if (!(dir = opendir(dirpath))) {
+		return;
+	}
+	names = NULL;
+	count = size = 0;
+	while ((ent = readdir(dir))) {
+		if (*ent->d_name == '.') {
+			continue;
+		}
+		if (count == size) {
+			size = (size ? size * 2 : 16);
+			names = saferealloc(names, sizeof(*names) * size);
+		}
+		names[count] = safealloc(strlen(ent->d_name) + 1);
+		strcpy(names[count++], ent->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, count, sizeof(*names), undo_cmp);
+	for (i=0; i<count; i++) {
+		if (i < count - fileop_opts()->undo) {
+			path = join_path(dirpath, names[i]);
+			unlink(path);
+			free(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+/*}}}*/
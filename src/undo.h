@@ -0,0 +1,32 @@
+/**
+ * The undo log: where the files that were moved, renamed or trashed went, so
+ * that they can be put back with a rename each, however big they are. A job
+ * notes its moves in an Undo as it goes, and once it's over writes them out as
+ * a batch, a file of its own in $XDG_STATE_HOME/sheriff/undo, named after when
+ * it was written. The log is shared by all the instances of a user, and
+ * outlives them: undoing claims the latest batch, wherever it came from, by
+ * renaming it, so that it can't be undone twice, and reverses it in a job of
+ * its own. Only the last Fileopts.undo batches are kept.
+ * Files moved across filesystems were copied, and are copied back.
+ */
+
+#ifndef UNDO_H
+#define UNDO_H
+
+#include "fileops.h"
+
+typedef struct undo {
+	int op;             /* OP_MOVE, or OP_DELETE for the trash */
+	char **from;        /* Where each file was */
+	char **to;          /* and where it went */
+	int count;
+} Undo;
+
+void  undo_add(Undo *u, const char *from, const char *to);
+int   undo_claim(char *path);
+void  undo_commit(Undo *u);
+void  undo_describe(const char *path, char *desc, size_t size);
+Undo* undo_new(int op);
+int   undo_run(const char *path, Progress *pr);
+
+#endif
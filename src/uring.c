@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+#include "utils.h"
+
+/* Unmap the rings and close the ring fd */
+void
+uring_deinit(Uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	}
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_ring_len);
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+	}
+	memset(ring, '\0', sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* Get a zeroed out submission queue entry, or NULL if the queue is full. The
+ * entry becomes visible to the kernel on the next uring_submit() */
+struct io_uring_sqe *
+uring_get_sqe(Uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head, idx;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+
+	idx = ring->sqe_tail & *ring->sq_mask;
+	sqe = ring->sqes + idx;
+	memset(sqe, '\0', sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+
+	ring->sqe_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/* Set up a ring with (at least) the specified number of entries. Returns 0 on
+ * success, or an errno-like value if the kernel doesn't want to play along */
+int
+uring_init(Uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(ring, '\0', sizeof(*ring));
+	memset(&p, '\0', sizeof(p));
+
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+		ring->fd = -1;
+		return errno;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(*ring->cqes);
+	ring->sqes_len = p.sq_entries * sizeof(*ring->sqes);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE,
+	                     MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE,
+	                     MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+	                  MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		err = errno;
+		uring_deinit(ring);
+		return err;
+	}
+
+	ring->sq_head = (unsigned*)((char*)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*)((char*)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned*)((char*)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+	ring->sqe_tail = *ring->sq_tail;
+
+	return 0;
+}
+
+/* Check whether the running kernel supports io_uring at all, and all of the
+ * opcodes listed in ops in particular. Returns 1 if it does, 0 otherwise */
+int
+uring_probe(const unsigned char *ops, int count)
+{
+	Uring ring;
+	struct io_uring_probe *probe;
+	size_t len;
+	int i, supported;
+
+	if (uring_init(&ring, 1)) {
+		return 0;
+	}
+
+	len = sizeof(*probe) + 256 * sizeof(probe->ops[0]);
+	probe = safealloc(len);
+	memset(probe, '\0', len);
+
+	supported = 0;
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+	            probe, 256) >= 0) {
+		supported = 1;
+		for (i=0; i<count; i++) {
+			if (ops[i] > probe->last_op ||
+			    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+				supported = 0;
+			}
+		}
+	}
+
+	free(probe);
+	uring_deinit(&ring);
+	return supported;
+}
+
+/* Hand all the pending submission entries over to the kernel. Returns 0 on
+ * success, an errno-like value otherwise */
+int
+uring_submit(Uring *ring)
+{
+	int ret;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	while (ring->to_submit > 0) {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0,
+		              NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return errno;
+		}
+		ring->to_submit -= ret;
+	}
+
+	return 0;
+}
+
+/* Wait for a completion to be available, and copy it into cqe. Returns 0 on
+ * success, an errno-like value otherwise */
+int
+uring_wait_cqe(Uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned head;
+
+	for (;;) {
+		head = *ring->cq_head;
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			*cqe = ring->cqes[head & *ring->cq_mask];
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+		            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			return errno;
+		}
+	}
+}
@@ -0,0 +1,34 @@
+/**
+ * Minimal io_uring wrapper, talking to the kernel through the raw syscalls so
+ * that no external library is needed. It only does what the fileops layer
+ * needs: set up a ring, hand out submission entries, submit them and reap the
+ * completions. None of these functions are thread-safe, so every thread that
+ * wants to batch its I/O has to set up its own ring.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+typedef struct {
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	unsigned sqe_tail;          /* Next sqe to hand out */
+	unsigned to_submit;         /* Entries handed out but not submitted yet */
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+} Uring;
+
+void                 uring_deinit(Uring *ring);
+struct io_uring_sqe* uring_get_sqe(Uring *ring);
+int                  uring_init(Uring *ring, unsigned entries);
+int                  uring_probe(const unsigned char *ops, int count);
+int                  uring_submit(Uring *ring);
+int                  uring_wait_cqe(Uring *ring, struct io_uring_cqe *cqe);
+
+#endif
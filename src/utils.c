@@ -37,6 +37,40 @@ extract_filename(const char *path)
 	return NULL;
 }
 
+/* Parse a size the way tohuman() writes them, e.g. "1.5 M" or "10K", into a
+ * number of bytes. Returns 0 on success, -1 if str isn't a size */
+int
+fromhuman(const char *str, unsigned long *bytes)
+{
+	const char suffix[] = "BKMGTPE";
+	double val;
+	char *end;
+	int i;
+
+	val = strtod(str, &end);
+	if (end == str || !(val >= 0)) {
+		return -1;
+	}
+	while (*end == ' ') {
+		end++;
+	}
+
+	for (i = 0; *end != '\0' && suffix[i] != toupper(*end); i++) {
+		if (suffix[i] == '\0') {
+			return -1;
+		}
+	}
+	if (*end != '\0' && end[1] != '\0') {
+		return -1;
+	}
+
+	for (; i > 0; i--) {
+		val *= 1000;
+	}
+	*bytes = val;
+	return 0;
+}
+
 /* Check if a directory is "." or ".." more efficiently than calling strcmp
  * twice */
 int
@@ -110,6 +144,17 @@ safealloc(size_t s)
 	return ret;
 }
 
+/* Same, for realloc */
+void*
+saferealloc(void *p, size_t s)
+{
+	void *ret;
+
+	ret = realloc(p, s);
+	assert(ret);
+	return ret;
+}
+
 /* Compare two strings case-insensitively */
 char*
 strcasestr(const char *haystack, const char *needle)
@@ -149,6 +194,72 @@ strchomp(const char *src, char *dest, const int maxlen)
 	return 0;
 }
 
+/* Undo pct_encode(), in place. Returns -1 if str isn't well formed */
+int
+pct_decode(char *str)
+{
+	const char *digits = "0123456789ABCDEF";
+	const char *hi, *lo;
+	char *out;
+
+	for (out = str; *str; str++) {
+		if (*str != '%') {
+			*out++ = *str;
+			continue;
+		}
+		if (!str[1] || !(hi = strchr(digits, toupper(str[1]))) ||
+		    !str[2] || !(lo = strchr(digits, toupper(str[2])))) {
+			return -1;
+		}
+		*out++ = (hi - digits) << 4 | (lo - digits);
+		str += 2;
+	}
+	*out = '\0';
+
+	return 0;
+}
+
+/* Percent-encode str into dest the way URIs want it, leaving the unreserved
+ * characters and slashes alone. Returns -1 if it doesn't fit in len bytes */
+int
+pct_encode(const char *str, char *dest, size_t len)
+{
+	const unsigned char *c;
+	size_t i;
+
+	for (c = (const unsigned char*)str, i = 0; *c; c++) {
+		if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+		    (*c >= '0' && *c <= '9') || strchr("-._~/", *c)) {
+			if (i + 1 >= len) {
+				return -1;
+			}
+			dest[i++] = *c;
+		} else {
+			if (i + 3 >= len) {
+				return -1;
+			}
+			i += sprintf(dest + i, "%%%02X", *c);
+		}
+	}
+	dest[i] = '\0';
+
+	return 0;
+}
+
+/* Write a line to fp, key followed by val percent-encoded. Returns -1 on
+ * failure */
+int
+pct_put(FILE *fp, const char *key, const char *val)
+{
+	char enc[PCT_LINE_LEN];
+
+	if (pct_encode(val, enc, sizeof(enc)) ||
+	    fprintf(fp, "%s%s\n", key, enc) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
 /* Human formatting of file sizes */
 void
 tohuman(unsigned long bytes, char *human)
@@ -5,14 +5,23 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 
+#define PCT_LINE_LEN (PATH_MAX * 3 + 16)    /* Fits a percent-encoded path */
+
 int   atoo(const char *str);
 char* extract_filename(const char *path);
+int   fromhuman(const char *str, unsigned long *bytes);
 int   is_dot_or_dotdot(char *name);
 char* join_path(const char *parent, const char *child);
 void  octal_to_str(int oct, char str[]);
+int   pct_decode(char *str);
+int   pct_encode(const char *str, char *dest, size_t len);
+int   pct_put(FILE *fp, const char *key, const char *val);
 void* safealloc(size_t s);
+void* saferealloc(void *p, size_t s);
 char* strcasestr(const char *haystack, const char *needle);
 int   strchomp(const char *src, char *dest, const int maxlen);
 void  tohuman(unsigned long bytes, char *human);
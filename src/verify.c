@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fileops.h"
+#include "hash.h"
+#include "utils.h"
+#include "verify.h"
+
+#define VERIFY_BUFSIZE (1024 * 1024)
+#define VERIFY_BACKLOG (256 * 1024 * 1024)  /* Bytes a move can copy ahead */
+
+struct verify_item {
+	struct verify_item *next;
+	char *dest;
+	off_t size;
+	char src[];
+};
+
+struct verifier {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t drained;     /* Signalled as the backlog shrinks */
+	struct verify_item *head, *tail;
+	off_t backlog;              /* Bytes queued, and not dealt with yet */
+	int mode;                   /* Bitmask of enum verify_modes */
+	int done;                   /* No more files are coming */
+	unsigned mismatches;        /* Or files that couldn't be removed */
+	Progress *pr;
+	pthread_t thread;
+	char *buf;
+};
+
+static int   verify_file(const char *path, char *buf, uint64_t *digest,
+                         off_t *size);
+static int   verify_item(Verifier *v, const struct verify_item *item);
+static void  verify_mismatch(Verifier *v);
+static void  verify_remove(Verifier *v, const struct verify_item *item);
+static void* verify_worker(void *arg);
+
+/* Wait for all the queued files to be checked, and free v. Returns how many
+ * of them didn't match */
+unsigned
+verify_finish(Verifier *v)
+{
+	unsigned mismatches;
+
+	pthread_mutex_lock(&v->mutex);
+	v->done = 1;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->mutex);
+
+	pthread_join(v->thread, NULL);
+
+	mismatches = v->mismatches;
+	pthread_cond_destroy(&v->drained);
+	pthread_cond_destroy(&v->cond);
+	pthread_mutex_destroy(&v->mutex);
+	free(v->buf);
+	free(v);
+
+	return mismatches;
+}
+
+/* Queue dest to be checked against src, size being how much was copied. Both
+ * paths are copied. When removing, waits for the backlog to go down if it's
+ * grown too big */
+void
+verify_queue(Verifier *v, const char *src, const char *dest, off_t size)
+{
+	struct verify_item *item;
+	size_t srclen;
+
+	srclen = strlen(src) + 1;
+	item = safealloc(sizeof(*item) + srclen + strlen(dest) + 1);
+	item->next = NULL;
+	item->dest = item->src + srclen;
+	item->size = size;
+	strcpy(item->src, src);
+	strcpy(item->dest, dest);
+
+	pthread_mutex_lock(&v->mutex);
+	while (v->mode & VERIFY_REMOVE && v->head && v->backlog > VERIFY_BACKLOG) {
+		pthread_cond_wait(&v->drained, &v->mutex);
+	}
+	v->backlog += size;
+	if (v->tail) {
+		v->tail->next = item;
+	} else {
+		v->head = item;
+	}
+	v->tail = item;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->mutex);
+}
+
+/* Start a verifier thread doing mode to the files queued, reporting to pr.
+ * Returns NULL if the thread can't be started */
+Verifier *
+verify_start(Progress *pr, int mode)
+{
+	Verifier *v;
+
+	v = safealloc(sizeof(*v));
+	memset(v, '\0', sizeof(*v));
+	pthread_mutex_init(&v->mutex, NULL);
+	pthread_cond_init(&v->cond, NULL);
+	pthread_cond_init(&v->drained, NULL);
+	v->pr = pr;
+	v->mode = mode;
+	v->buf = safealloc(VERIFY_BUFSIZE);
+
+	if (pthread_create(&v->thread, NULL, verify_worker, v)) {
+		pthread_cond_destroy(&v->drained);
+		pthread_cond_destroy(&v->cond);
+		pthread_mutex_destroy(&v->mutex);
+		free(v->buf);
+		free(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+/* Static functions {{{*/
+/* Hash a whole file. Returns 0 on success, an errno value otherwise */
+int
+verify_file(const char *path, char *buf, uint64_t *digest, off_t *size)
+{
+	Hash h;
+	ssize_t n;
+	int fd, retval;
+
+	if ((fd = open(path, O_RDONLY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		return errno;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	hash_init(&h, 0);
+	while ((n = read(fd, buf, VERIFY_BUFSIZE)) > 0) {
+		hash_update(&h, buf, n);
+	}
+	retval = (n < 0 ? errno : 0);
+	close(fd);
+
+	*digest = hash_digest(&h);
+	*size = h.total;
+	return retval;
+}
+
+/* Check a single file, and report it if it doesn't match its source. Returns
+ * 0 if it does, or there's no telling and the source is staying, -1 otherwise */
+int
+verify_item(Verifier *v, const struct verify_item *item)
+{
+	uint64_t src_digest, dest_digest;
+	off_t src_size, dest_size;
+
+	/* Can't read the source: there's nothing to compare to. Which is fine,
+	 * unless it's about to be removed */
+	if (verify_file(item->src, v->buf, &src_digest, &src_size)) {
+		if (!(v->mode & VERIFY_REMOVE)) {
+			return 0;
+		}
+		verify_mismatch(v);
+		progress_error(v->pr, "Can't check, kept: %s", item->src);
+		return -1;
+	}
+	if (!verify_file(item->dest, v->buf, &dest_digest, &dest_size) &&
+	    src_size == dest_size && src_digest == dest_digest) {
+		return 0;
+	}
+
+	verify_mismatch(v);
+	progress_error(v->pr, "Checksum mismatch: %s", item->dest);
+	return -1;
+}
+
+/* Count a file that failed to check out, or to be removed */
+void
+verify_mismatch(Verifier *v)
+{
+	v->mismatches++;
+	__atomic_fetch_add(&v->pr->mismatches, 1, __ATOMIC_RELAXED);
+}
+
+/* Remove the source of a moved file, if its copy is there and of the same
+ * type. Regular files also have to be all there, match when hashing, and be on
+ * disk */
+void
+verify_remove(Verifier *v, const struct verify_item *item)
+{
+	struct stat src_st, dest_st;
+	int fd, err;
+
+	if (lstat(item->src, &src_st) < 0) {
+		return;
+	}
+	if (lstat(item->dest, &dest_st) < 0 ||
+	    (dest_st.st_mode & S_IFMT) != (src_st.st_mode & S_IFMT)) {
+		verify_mismatch(v);
+		progress_error(v->pr, "No copy, kept: %s", item->src);
+		return;
+	}
+	if (S_ISREG(src_st.st_mode)) {
+		if (dest_st.st_size != src_st.st_size) {
+			verify_mismatch(v);
+			progress_error(v->pr, "Size mismatch, kept: %s", item->src);
+			return;
+		}
+		if (v->mode & VERIFY_HASH && verify_item(v, item)) {
+			return;
+		}
+		/* The source is the only copy that's sure to survive a crash,
+		 * until the new one is synced. Strict copies are synced already */
+		if (fileop_opts()->durability == DURABLE_BATCH) {
+			if ((fd = open(item->dest, O_RDONLY|O_CLOEXEC)) < 0 ||
+			    fsync(fd) < 0) {
+				err = errno;
+				if (fd >= 0) {
+					close(fd);
+				}
+				verify_mismatch(v);
+				progress_error(v->pr, "Can't sync %s: %s", item->dest,
+				               strerror(err));
+				return;
+			}
+			close(fd);
+		}
+	}
+
+	if (unlink(item->src) < 0) {
+		verify_mismatch(v);
+		progress_error(v->pr, "Can't remove %s: %s", item->src,
+		               strerror(errno));
+	}
+}
+
+/* Check files as they get queued, until verify_finish() is called */
+void *
+verify_worker(void *arg)
+{
+	struct verify_item *item;
+	Verifier *v;
+
+	v = arg;
+	for (;;) {
+		pthread_mutex_lock(&v->mutex);
+		while (!v->head && !v->done) {
+			pthread_cond_wait(&v->cond, &v->mutex);
+		}
+		if (!(item = v->head)) {
+			pthread_mutex_unlock(&v->mutex);
+			break;
+		}
+		if (!(v->head = item->next)) {
+			v->tail = NULL;
+		}
+		pthread_mutex_unlock(&v->mutex);
+
+		if (v->mode & VERIFY_REMOVE) {
+			verify_remove(v, item);
+		} else {
+			verify_item(v, item);
+		}
+
+		pthread_mutex_lock(&v->mutex);
+		v->backlog -= item->size;
+		pthread_cond_signal(&v->drained);
+		pthread_mutex_unlock(&v->mutex);
+		free(item);
+	}
+
+	return NULL;
+}
+/*}}}*/
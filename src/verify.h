@@ -0,0 +1,31 @@
+/**
+ * Verification of copied files. Files are queued as soon as they've been
+ * copied, and a thread of its own hashes both sides while the copy moves on to
+ * the next ones, so that checking the data doesn't double the time it takes
+ * to copy it. Mismatches are reported through the Progress struct, one file at
+ * a time.
+ * Moves across filesystems go through here too, to get rid of their sources:
+ * once a copy is found to be whole, by its size if not by its hash, and safely
+ * on disk, its source is removed. The copy only gets so far ahead of the
+ * removals, so that the space taken twice stays bounded.
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "fileops.h"
+
+/* What's done to the queued files, a bitmask */
+enum verify_modes {
+	VERIFY_HASH = 1,    /* Compare their contents with the sources' */
+	VERIFY_REMOVE = 2   /* Remove the sources of the files that check out */
+};
+
+typedef struct verifier Verifier;
+
+unsigned  verify_finish(Verifier *v);
+void      verify_queue(Verifier *v, const char *src, const char *dest,
+                       off_t size);
+Verifier* verify_start(Progress *pr, int mode);
+
+#endif
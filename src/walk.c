@@ -0,0 +1,690 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fileops.h"
+#include "utils.h"
+#include "walk.h"
+
+#define WALK_BUFSIZE (32 * 1024)    /* Initial getdents64() buffer size */
+
+/* A directory in a parallel walk. It sticks around, fd included, until all of
+ * its subdirectories are done with, since they need it as their dirfd */
+struct pwalk_node {
+	struct pwalk_node *parent, *next;
+	int fd;
+	int depth;
+	unsigned pending;       /* Subdirectories left, plus one for the scan */
+	struct stat st;
+	char name[];
+};
+
+/* State shared by all the threads taking part in a parallel walk */
+struct pwalk {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct pwalk_node *todo;    /* Directories waiting to be scanned */
+	int busy;                   /* Threads currently scanning a directory */
+	int rootfd;
+	Walkfn fn;
+	void *arg;
+	int flags;
+	Progress *progress;
+	int status;
+};
+
+static void            pwalk_finish(struct pwalk *pw, Walk *w,
+                                    struct pwalk_node *node, int post);
+static void            pwalk_push(struct pwalk *pw, struct pwalk_node *parent,
+                                  const char *name, const struct stat *st);
+static void            pwalk_scan(struct pwalk *pw, Walk *w,
+                                  struct pwalk_node *node, char *buf);
+static void*           pwalk_worker(void *arg);
+static int             walk_call(Walk *w, int event, int dirfd,
+                                 const char *name, const struct stat *st);
+static void            walk_enter(Walk *w, int dirfd, const char *name,
+                                  const struct stat *st);
+static void            walk_evict(Walk *w, struct walk_frame *f);
+static void            walk_flush(Walk *w);
+static void            walk_leave(Walk *w, int rootfd);
+static const char*     walk_name(const Walk *w, int idx);
+static struct dirent64* walk_next(Walk *w, struct walk_frame *f);
+static int             walk_open_parent(const char *path, const char **name);
+static int             walk_reopen(int childfd, int *fd, dev_t dev, ino_t ino);
+static int             walk_run(Walk *w, int rootfd, const char *name);
+static void            walk_setpath(Walk *w, size_t len, const char *name);
+
+/* Walk the tree rooted at path, calling fn on every node. Returns the last
+ * error encountered, or 0 if everything went fine */
+int
+walk_tree(const char *path, Walkfn fn, void *arg, int flags, Progress *pr)
+{
+	Walk w;
+	const char *name;
+	int rootfd;
+
+	if ((rootfd = walk_open_parent(path, &name)) < 0) {
+		return errno;
+	}
+
+	memset(&w, '\0', sizeof(w));
+	w.fn = fn;
+	w.arg = arg;
+	w.flags = flags;
+	w.progress = pr;
+	w.pathsize = strlen(path) + NAME_MAX + 2;
+	w.path = safealloc(sizeof(*w.path) * w.pathsize);
+	strcpy(w.path, path);
+	w.found = 1;            /* The root isn't listed in any directory we read */
+
+	walk_run(&w, rootfd, name);
+
+	close(rootfd);
+	free(w.path);
+	return w.status;
+}
+
+/* Same as walk_tree(), but with up to threads threads scanning different
+ * directories at the same time. Subtrees deeper than WALK_MAXFDS are walked
+ * serially, to keep the number of open fds in check */
+int
+walk_tree_parallel(const char *path, Walkfn fn, void *arg, int flags,
+                   Progress *pr, int threads)
+{
+	struct pwalk pw;
+	struct stat st;
+	pthread_t *thr;
+	Walk w;
+	const char *name;
+	int i, spawned;
+
+	if (threads <= 1) {
+		return walk_tree(path, fn, arg, flags, pr);
+	}
+
+	if ((pw.rootfd = walk_open_parent(path, &name)) < 0) {
+		return errno;
+	}
+	if (fstatat(pw.rootfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		pw.status = errno;
+		close(pw.rootfd);
+		return pw.status;
+	}
+
+	/* Not a directory: nothing to parallelize */
+	if (!S_ISDIR(st.st_mode)) {
+		memset(&w, '\0', sizeof(w));
+		w.fn = fn;
+		w.arg = arg;
+		w.flags = flags;
+		w.progress = pr;
+		w.path = (char*)path;
+		w.found = 1;
+		walk_call(&w, WALK_FILE, pw.rootfd, name, &st);
+		walk_flush(&w);
+		close(pw.rootfd);
+		return w.status;
+	}
+
+	pthread_mutex_init(&pw.mutex, NULL);
+	pthread_cond_init(&pw.cond, NULL);
+	pw.todo = NULL;
+	pw.busy = 0;
+	pw.fn = fn;
+	pw.arg = arg;
+	pw.flags = flags;
+	pw.progress = pr;
+	pw.status = 0;
+	pwalk_push(&pw, NULL, name, &st);
+
+	/* The calling thread is one of the workers too */
+	thr = safealloc(sizeof(*thr) * (threads - 1));
+	for (i=0, spawned=0; i<threads-1; i++) {
+		if (!pthread_create(thr + spawned, NULL, pwalk_worker, &pw)) {
+			spawned++;
+		}
+	}
+	pwalk_worker(&pw);
+	for (i=0; i<spawned; i++) {
+		pthread_join(thr[i], NULL);
+	}
+	free(thr);
+
+	pthread_cond_destroy(&pw.cond);
+	pthread_mutex_destroy(&pw.mutex);
+	close(pw.rootfd);
+	return pw.status;
+}
+
+/* Static functions {{{*/
+/* Drop the scan reference to a node. Whoever drops the last reference to a
+ * directory gets to visit it one last time, and then drops the reference the
+ * directory holds on its parent, all the way up */
+void
+pwalk_finish(struct pwalk *pw, Walk *w, struct pwalk_node *node, int post)
+{
+	struct pwalk_node *parent;
+
+	while (node && !__atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL)) {
+		parent = node->parent;
+		if (node->fd >= 0) {
+			close(node->fd);
+		}
+		if (post) {
+			strcpy(w->path, node->name);
+			w->depth = node->depth;
+			w->child_ufd = -1;
+			walk_call(w, WALK_DIR_POST, parent ? parent->fd : pw->rootfd,
+			          node->name, &node->st);
+		}
+		free(node);
+		node = parent;
+		post = 1;
+	}
+}
+
+/* Queue a directory for scanning */
+void
+pwalk_push(struct pwalk *pw, struct pwalk_node *parent, const char *name,
+           const struct stat *st)
+{
+	struct pwalk_node *node;
+
+	node = safealloc(sizeof(*node) + strlen(name) + 1);
+	node->parent = parent;
+	node->fd = -1;
+	node->depth = (parent ? parent->depth + 1 : 0);
+	node->pending = 1;
+	node->st = *st;
+	strcpy(node->name, name);
+
+	if (parent) {
+		__atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+	}
+
+	/* LIFO, so that the walk goes deep before going wide: this way only the
+	 * ancestors of the directories being scanned are keeping fds open */
+	pthread_mutex_lock(&pw->mutex);
+	node->next = pw->todo;
+	pw->todo = node;
+	pthread_cond_signal(&pw->cond);
+	pthread_mutex_unlock(&pw->mutex);
+}
+
+/* Visit a directory: files are handed to the callback on the spot, while
+ * subdirectories are queued for any thread to pick up */
+void
+pwalk_scan(struct pwalk *pw, Walk *w, struct pwalk_node *node, char *buf)
+{
+	Walk sub;
+	struct dirent64 *de;
+	struct stat st;
+	ssize_t n, pos;
+	int parentfd;
+
+	parentfd = (node->parent ? node->parent->fd : pw->rootfd);
+	w->depth = node->depth;
+	strcpy(w->path, node->name);
+	if (!node->parent) {
+		w->found++;
+	}
+
+	/* Too deep to keep a fd open per level, switch to the serial walker */
+	if (node->depth >= WALK_MAXFDS) {
+		memset(&sub, '\0', sizeof(sub));
+		sub.fn = w->fn;
+		sub.arg = w->arg;
+		sub.flags = w->flags;
+		sub.progress = w->progress;
+		sub.pathsize = NAME_MAX + 1;
+		sub.path = safealloc(sizeof(*sub.path) * sub.pathsize);
+		strcpy(sub.path, node->name);
+		if (walk_run(&sub, parentfd, node->name)) {
+			w->status = sub.status;
+		}
+		free(sub.path);
+		pwalk_finish(pw, w, node, 0);
+		return;
+	}
+
+	w->child_ufd = -1;
+	if (walk_call(w, WALK_DIR_PRE, parentfd, node->name, &node->st)) {
+		pwalk_finish(pw, w, node, 0);
+		return;
+	}
+
+	node->fd = openat(parentfd, node->name,
+	                  O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (node->fd < 0) {
+		w->status = errno;
+		pwalk_finish(pw, w, node, 1);
+		return;
+	}
+
+	while ((n = getdents64(node->fd, buf, WALK_BUFSIZE)) > 0) {
+		for (pos = 0; pos < n; pos += de->d_reclen) {
+			de = (struct dirent64*)(buf + pos);
+			if (is_dot_or_dotdot(de->d_name)) {
+				continue;
+			}
+
+			st.st_mode = DTTOIF(de->d_type);
+			if ((w->flags & WALK_STAT) || de->d_type == DT_UNKNOWN) {
+				if (fstatat(node->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+					w->status = errno;
+					continue;
+				}
+			}
+			w->found++;
+
+			if (S_ISDIR(st.st_mode)) {
+				pwalk_push(pw, node, de->d_name, &st);
+			} else {
+				strcpy(w->path, de->d_name);
+				w->depth = node->depth + 1;
+				walk_call(w, WALK_FILE, node->fd, de->d_name, &st);
+			}
+		}
+	}
+	if (n < 0) {
+		w->status = errno;
+	}
+
+	pwalk_finish(pw, w, node, 1);
+}
+
+/* Body of each thread in a parallel walk: keep scanning directories until
+ * there are none left, and no other thread can queue any more */
+void *
+pwalk_worker(void *arg)
+{
+	struct pwalk *pw;
+	struct pwalk_node *node;
+	Walk w;
+	char *buf;
+
+	pw = arg;
+	memset(&w, '\0', sizeof(w));
+	w.fn = pw->fn;
+	w.arg = pw->arg;
+	w.flags = pw->flags;
+	w.progress = pw->progress;
+	w.ufd = -1;
+	w.pathsize = NAME_MAX + 1;
+	w.path = safealloc(sizeof(*w.path) * w.pathsize);
+	buf = safealloc(WALK_BUFSIZE);
+
+	pthread_mutex_lock(&pw->mutex);
+	for (;;) {
+		while (!pw->todo && pw->busy > 0) {
+			pthread_cond_wait(&pw->cond, &pw->mutex);
+		}
+		if (!pw->todo) {
+			break;
+		}
+
+		node = pw->todo;
+		pw->todo = node->next;
+		pw->busy++;
+		pthread_mutex_unlock(&pw->mutex);
+
+		pwalk_scan(pw, &w, node, buf);
+
+		pthread_mutex_lock(&pw->mutex);
+		pw->busy--;
+		if (!pw->todo && !pw->busy) {
+			pthread_cond_broadcast(&pw->cond);
+		}
+	}
+	if (w.status) {
+		pw->status = w.status;
+	}
+	pthread_mutex_unlock(&pw->mutex);
+
+	walk_flush(&w);
+	free(buf);
+	free(w.path);
+	return NULL;
+}
+
+/* Call the callback on a node, and report progress every WALK_TICK nodes.
+ * Every node counts once against the object rate limits, if there are any.
+ * Once the walk has been cancelled, the callback isn't called anymore, and
+ * the directories left are skipped rather than entered */
+int
+walk_call(Walk *w, int event, int dirfd, const char *name,
+          const struct stat *st)
+{
+	int err;
+
+	if ((err = progress_throttle(w->progress, 0, event != WALK_DIR_POST)) ||
+	    (err = w->fn(w, event, dirfd, name, st))) {
+		w->status = err;
+	}
+
+	if (event != WALK_DIR_PRE && w->progress && ++w->done >= WALK_TICK) {
+		progress_add(w->progress, w->found, w->done, w->path);
+		w->found = 0;
+		w->done = 0;
+	}
+
+	return err;
+}
+
+/* Visit a directory, and push it on the stack so that its contents will be
+ * visited next */
+void
+walk_enter(Walk *w, int dirfd, const char *name, const struct stat *st)
+{
+	struct walk_frame *f;
+	int fd;
+
+	w->depth = w->stacksize;
+	w->ufd = w->stacksize ? w->stack[w->stacksize - 1].ufd : -1;
+	w->child_ufd = -1;
+
+	if (walk_call(w, WALK_DIR_PRE, dirfd, name, st)) {
+		if (w->child_ufd >= 0) {
+			close(w->child_ufd);
+		}
+		return;
+	}
+
+	/* Can't get in: there are no contents to visit, so we're done with it */
+	if ((fd = openat(dirfd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		w->status = errno;
+		if (w->child_ufd >= 0) {
+			close(w->child_ufd);
+			w->child_ufd = -1;
+		}
+		walk_call(w, WALK_DIR_POST, dirfd, name, st);
+		return;
+	}
+
+	if (!(w->stacksize % 16)) {
+		w->stack = realloc(w->stack, sizeof(*w->stack) * (w->stacksize + 16));
+	}
+
+	f = w->stack + w->stacksize;
+	memset(f, '\0', sizeof(*f));
+	f->fd = fd;
+	f->ufd = w->child_ufd;
+	f->st = *st;
+	f->pathlen = strlen(w->path);
+
+	/* The name lives in the parent buffer, which might move around when the
+	 * parent gets evicted: keep track of its offset instead of a pointer */
+	if (w->stacksize > 0) {
+		f->nameoff = name - (f - 1)->buf;
+	}
+	w->stacksize++;
+
+	/* Don't keep more than WALK_MAXFDS levels open */
+	if (w->stacksize > WALK_MAXFDS) {
+		walk_evict(w, w->stack + w->stacksize - WALK_MAXFDS - 1);
+	}
+}
+
+/* Close the fds associated with a directory, so that they can be used by
+ * deeper levels. Whatever is left to read from the directory is read now */
+void
+walk_evict(Walk *w, struct walk_frame *f)
+{
+	struct stat st;
+	ssize_t n;
+
+	if (f->fd < 0) {
+		return;
+	}
+
+	while (!f->eof) {
+		if (f->bufsize - f->len < WALK_BUFSIZE) {
+			f->bufsize += WALK_BUFSIZE;
+			f->buf = realloc(f->buf, f->bufsize);
+		}
+		if ((n = getdents64(f->fd, f->buf + f->len, f->bufsize - f->len)) <= 0) {
+			if (n < 0) {
+				w->status = errno;
+			}
+			f->eof = 1;
+		} else {
+			f->len += n;
+		}
+	}
+
+	fstat(f->fd, &st);
+	f->dev = st.st_dev;
+	f->ino = st.st_ino;
+	close(f->fd);
+	f->fd = -1;
+
+	if (f->ufd >= 0) {
+		fstat(f->ufd, &st);
+		f->udev = st.st_dev;
+		f->uino = st.st_ino;
+		close(f->ufd);
+		f->ufd = -2;    /* Not -1: there is a fd to get back */
+	}
+}
+
+/* Report whatever progress hasn't been reported yet. This also makes sure
+ * the progress doesn't point to our path anymore, as it's about to go away */
+void
+walk_flush(Walk *w)
+{
+	if (w->progress) {
+		progress_add(w->progress, w->found, w->done, NULL);
+		w->found = 0;
+		w->done = 0;
+	}
+}
+
+/* Pop the topmost directory from the stack, and visit it one last time */
+void
+walk_leave(Walk *w, int rootfd)
+{
+	struct walk_frame *f, *p;
+	int dirfd, err;
+
+	f = w->stack + w->stacksize - 1;
+	p = (w->stacksize > 1 ? f - 1 : NULL);
+
+	/* Get the parent fds back if they were closed */
+	if (p && p->fd < 0) {
+		if ((err = walk_reopen(f->fd, &p->fd, p->dev, p->ino))) {
+			w->status = err;
+			p->pos = p->len;
+		}
+	}
+	if (p && p->ufd == -2) {
+		if ((err = walk_reopen(f->ufd, &p->ufd, p->udev, p->uino))) {
+			w->status = err;
+			p->ufd = -1;
+		}
+	}
+
+	close(f->fd);
+	free(f->buf);
+
+	w->stacksize--;
+	w->depth = w->stacksize;
+	w->ufd = p ? p->ufd : -1;
+	w->child_ufd = f->ufd;
+	w->path[f->pathlen] = '\0';
+	dirfd = p ? p->fd : rootfd;
+
+	walk_call(w, WALK_DIR_POST, dirfd, walk_name(w, w->stacksize), &f->st);
+
+	if (f->ufd >= 0) {
+		close(f->ufd);
+	}
+}
+
+/* Name of the idxth directory on the stack */
+const char *
+walk_name(const Walk *w, int idx)
+{
+	return idx ? w->stack[idx - 1].buf + w->stack[idx].nameoff : w->rootname;
+}
+
+/* Get the next entry in a directory, reading more from the fd if needed.
+ * Returns NULL once the directory has been fully read */
+struct dirent64 *
+walk_next(Walk *w, struct walk_frame *f)
+{
+	struct dirent64 *de;
+	ssize_t n;
+
+	if (f->pos >= f->len) {
+		if (f->eof) {
+			return NULL;
+		}
+		if (!f->buf) {
+			f->bufsize = WALK_BUFSIZE;
+			f->buf = safealloc(f->bufsize);
+		}
+		if ((n = getdents64(f->fd, f->buf, f->bufsize)) <= 0) {
+			if (n < 0) {
+				w->status = errno;
+			}
+			f->eof = 1;
+			return NULL;
+		}
+		f->len = n;
+		f->pos = 0;
+	}
+
+	de = (struct dirent64*)(f->buf + f->pos);
+	f->pos += de->d_reclen;
+	return de;
+}
+
+/* Open the parent directory of path, and point name to the last component of
+ * path. Returns the fd, or -1 with errno set */
+int
+walk_open_parent(const char *path, const char **name)
+{
+	char *parent;
+	int fd;
+
+	parent = safealloc(sizeof(*parent) * (strlen(path) + 2));
+	if ((*name = strrchr(path, '/'))) {
+		strcpy(parent, path);
+		parent[*name == path ? 1 : *name - path] = '\0';
+		(*name)++;
+	} else {
+		strcpy(parent, ".");
+		*name = path;
+	}
+	if (**name == '\0') {
+		*name = ".";
+	}
+
+	fd = open(parent, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	free(parent);
+	return fd;
+}
+
+/* Re-open a directory through the ".." entry of one of its children, making
+ * sure it's still the same directory we left */
+int
+walk_reopen(int childfd, int *fd, dev_t dev, ino_t ino)
+{
+	struct stat st;
+
+	if (childfd < 0) {
+		return EBADF;
+	}
+	if ((*fd = openat(childfd, "..", O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+		return errno;
+	}
+	if (fstat(*fd, &st) < 0 || st.st_dev != dev || st.st_ino != ino) {
+		close(*fd);
+		*fd = -1;
+		return ESTALE;
+	}
+
+	return 0;
+}
+
+/* Walk the tree rooted at name, in the directory rootfd. w->path must already
+ * hold the path of the root */
+int
+walk_run(Walk *w, int rootfd, const char *name)
+{
+	struct walk_frame *f;
+	struct dirent64 *de;
+	struct stat st;
+
+	w->ufd = -1;
+	w->rootname = name;
+
+	if (fstatat(rootfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		w->status = errno;
+		return w->status;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		walk_enter(w, rootfd, name, &st);
+	} else {
+		walk_call(w, WALK_FILE, rootfd, name, &st);
+	}
+
+	/* Consume the topmost directory on the stack, one entry at a time. This
+	 * is where the recursion would be, if there was any */
+	while (w->stacksize > 0) {
+		f = w->stack + w->stacksize - 1;
+		if (!(de = walk_next(w, f))) {
+			walk_leave(w, rootfd);
+			continue;
+		}
+		if (is_dot_or_dotdot(de->d_name)) {
+			continue;
+		}
+
+		walk_setpath(w, f->pathlen, de->d_name);
+		st.st_mode = DTTOIF(de->d_type);
+		if ((w->flags & WALK_STAT) || de->d_type == DT_UNKNOWN) {
+			if (fstatat(f->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+				w->status = errno;
+				continue;
+			}
+		}
+		w->found++;
+
+		if (S_ISDIR(st.st_mode)) {
+			walk_enter(w, f->fd, de->d_name, &st);
+		} else {
+			w->depth = w->stacksize;
+			w->ufd = f->ufd;
+			walk_call(w, WALK_FILE, f->fd, de->d_name, &st);
+		}
+	}
+
+	free(w->stack);
+	w->stack = NULL;
+	walk_flush(w);
+	return w->status;
+}
+
+/* Replace whatever follows the first len chars in the current path with
+ * /name, growing the path buffer if needed */
+void
+walk_setpath(Walk *w, size_t len, const char *name)
+{
+	size_t need;
+
+	need = len + strlen(name) + 2;
+	if (need > w->pathsize) {
+		w->pathsize = need * 2;
+		w->path = realloc(w->path, w->pathsize);
+	}
+
+	w->path[len] = '/';
+	strcpy(w->path + len + 1, name);
+}
+/*}}}*/
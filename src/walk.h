@@ -0,0 +1,87 @@
+/**
+ * Iterative, fd-relative directory tree walker. Every node is handed to a
+ * callback together with a fd to its parent directory and its bare name, so
+ * that callbacks can use the *at() family of syscalls without ever building
+ * a full path. The walk keeps an explicit stack instead of recursing, and
+ * closes the fds of far away ancestors (re-opening them through ".." on the
+ * way back up), so arbitrarily deep trees need neither stack space nor fds
+ * proportional to their depth.
+ * Directories are reported twice: once before their contents (WALK_DIR_PRE)
+ * and once after (WALK_DIR_POST). While handling WALK_DIR_PRE, a callback can
+ * pair another directory fd to the directory being entered by setting
+ * child_ufd (e.g. the destination directory of a copy): the walker will keep
+ * track of it, and hand it back as ufd while visiting the directory contents,
+ * and as child_ufd on WALK_DIR_POST.
+ * walk_tree_parallel() does the same with a pool of threads, each of them
+ * scanning a different directory. It doesn't support ufds, and every callback
+ * can be called from any of the threads, with only the node name in path.
+ * Both walkers take care of reporting progress, if they're given a Progress
+ * struct: a node is added to the total as soon as it's read from its parent
+ * directory, and counts as done once its last callback (WALK_FILE or
+ * WALK_DIR_POST) has returned. They also stop calling the callback as soon as
+ * the Progress struct tells them the operation has been cancelled.
+ */
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "fileops.h"
+
+#define WALK_MAXFDS 64  /* Directory levels with open fds at any given time */
+#define WALK_TICK 64    /* Nodes to process before reporting progress */
+
+/* Flags */
+#define WALK_STAT 0x01  /* fstatat() every node instead of relying on d_type */
+
+enum walk_events {
+	WALK_FILE,          /* Anything that isn't a directory */
+	WALK_DIR_PRE,       /* Directory, before its contents are visited */
+	WALK_DIR_POST       /* Directory, after its contents have been visited */
+};
+
+typedef struct walk Walk;
+
+/* Callbacks return 0 on success, or an errno value which is recorded in
+ * status. A nonzero value returned on WALK_DIR_PRE also means that the
+ * directory contents should be skipped. Unless WALK_STAT is set, only the
+ * S_IFMT bits of st->st_mode are guaranteed to be valid */
+typedef int (*Walkfn)(Walk *w, int event, int dirfd, const char *name,
+                      const struct stat *st);
+
+struct walk_frame {
+	int fd, ufd;            /* Directory fd and the user fd paired with it */
+	struct stat st;         /* Directory stats, as handed to the callback */
+	dev_t dev, udev;        /* Identity of fd and ufd, used to check that */
+	ino_t ino, uino;        /* re-opens get the same directories back */
+	size_t nameoff;         /* Offset of the name in the parent buffer */
+	char *buf;              /* Raw getdents64() records */
+	size_t bufsize, len, pos;
+	int eof;
+	size_t pathlen;         /* Length of the directory path in Walk.path */
+};
+
+struct walk {
+	Walkfn fn;
+	void *arg;              /* Not touched by the walker, for the callback */
+	int flags;
+	int depth;              /* Depth of the node being visited, 0 is the root */
+	int ufd;                /* User fd paired to the parent of the node */
+	int child_ufd;          /* Set on WALK_DIR_PRE to pair a fd to the dir */
+	int status;             /* Last error returned by fn or hit while walking */
+	char *path;             /* Full path of the node being visited */
+	size_t pathsize;
+	const char *rootname;
+	Progress *progress;     /* Where to report progress, can be NULL */
+	unsigned found;         /* Nodes discovered but not reported yet */
+	unsigned done;          /* Nodes done but not reported yet */
+	struct walk_frame *stack;
+	int stacksize;
+};
+
+int walk_tree(const char *path, Walkfn fn, void *arg, int flags, Progress *pr);
+int walk_tree_parallel(const char *path, Walkfn fn, void *arg, int flags,
+                       Progress *pr, int threads);
+
+#endif
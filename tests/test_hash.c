@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+#include "minunit.h"
+
+#include "../src/hash.c"
+
+#define STREAMLEN 1000
+
+char *
+test_hash_known()
+{
+	const char *inputs[] = { "", "abc", "Nobody inspects the spammish repetition" };
+	const uint64_t digests[] = {
+		0xef46db3751d8e999ULL, 0x44bc2cf5ad770999ULL, 0xfbcea83c8a378bf1ULL
+	};
+	Hash h;
+	int i;
+
+	for (i=0; i<3; i++) {
+		hash_init(&h, 0);
+		hash_update(&h, inputs[i], strlen(inputs[i]));
+		mu_assert("hash_digest doesn't match XXH64", hash_digest(&h) == digests[i]);
+	}
+
+	return NULL;
+}
+
+char *
+test_hash_stream()
+{
+	unsigned char buf[STREAMLEN];
+	uint64_t whole;
+	Hash h;
+	int i, len;
+
+	for (i=0; i<STREAMLEN; i++) {
+		buf[i] = i * 7;
+	}
+	hash_init(&h, 0);
+	hash_update(&h, buf, STREAMLEN);
+	whole = hash_digest(&h);
+
+	/* Same data, fed in chunks that don't line up with the 32 bytes stripes */
+	hash_init(&h, 0);
+	for (i=0; i<STREAMLEN; i+=len) {
+		len = MIN(i % 37 + 1, STREAMLEN - i);
+		hash_update(&h, buf + i, len);
+	}
+	mu_assert("hash_update depends on chunk sizes", hash_digest(&h) == whole);
+
+	return NULL;
+}
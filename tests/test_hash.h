@@ -0,0 +1,7 @@
+#ifndef TEST_HASH_H
+#define TEST_HASH_H
+
+char* test_hash_known();
+char* test_hash_stream();
+
+#endif
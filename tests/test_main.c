@@ -1,5 +1,7 @@
 #include "minunit.h"
 #include "test_dir.h"
+#include "test_hash.h"
+#include "test_perms.h"
 #include "test_utils.h"
 
 int tests_run = 0;
@@ -14,6 +16,23 @@ test_all_dir()
 	return NULL;
 }
 
+char *
+test_all_hash()
+{
+	mu_run_test(test_hash_known);
+	mu_run_test(test_hash_stream);
+	return NULL;
+}
+
+char *
+test_all_perms()
+{
+	mu_run_test(test_perms_octal);
+	mu_run_test(test_perms_symbolic);
+	mu_run_test(test_perms_owner);
+	return NULL;
+}
+
 char *
 test_all_utils()
 {
@@ -22,6 +41,8 @@ test_all_utils()
 	mu_run_test(test_strcasestr);
 	mu_run_test(test_strchomp);
 	mu_run_test(test_tohuman);
+	mu_run_test(test_fromhuman);
+	mu_run_test(test_pct);
 	return NULL;
 }
 
@@ -37,6 +58,20 @@ main(int argc, char **argv)
 		goto end;
 	}
 
+	fprintf(stderr, "Testing hash.c\n");
+	res = test_all_hash();
+	if (res) {
+		fprintf(stderr, "%s\n", res);
+		goto end;
+	}
+
+	fprintf(stderr, "Testing perms.c\n");
+	res = test_all_perms();
+	if (res) {
+		fprintf(stderr, "%s\n", res);
+		goto end;
+	}
+
 	fprintf(stderr, "Testing dir.c\n");
 	res = test_all_dir();
 	if (res) {
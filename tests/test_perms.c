@@ -0,0 +1,85 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "minunit.h"
+
+#include "../src/perms.c"
+
+#define BADSPECS 8
+
+char *
+test_perms_octal()
+{
+	Perms p;
+
+	mu_assert("perms_parse rejected 755", !perms_parse(&p, "755"));
+	mu_assert("octal mode not set on files",
+	          perms_apply(&p, S_IFREG | 0600) == (S_IFREG | 0755));
+	mu_assert("octal mode not set on dirs",
+	          perms_apply(&p, S_IFDIR | 04700) == (S_IFDIR | 0755));
+
+	mu_assert("perms_parse rejected 644/755", !perms_parse(&p, "644/755"));
+	mu_assert("file mode used on dirs",
+	          perms_apply(&p, S_IFDIR | 0700) == (S_IFDIR | 0755));
+	mu_assert("dir mode used on files",
+	          perms_apply(&p, S_IFREG | 0700) == (S_IFREG | 0644));
+	mu_assert("owner set by a mode", p.uid == (uid_t)-1 && p.gid == (gid_t)-1);
+
+	return NULL;
+}
+
+char *
+test_perms_symbolic()
+{
+	const char *bad[BADSPECS] = { "", " ", "u", "u+rwz", "ugo", "u+r,", "644/",
+	                              "1777 755" };
+	Perms p;
+	int i;
+
+	mu_assert("perms_parse rejected u+rwX", !perms_parse(&p, "u+rwX"));
+	mu_assert("X made a plain file executable",
+	          perms_apply(&p, S_IFREG | 0044) == (S_IFREG | 0644));
+	mu_assert("X didn't keep an executable executable",
+	          perms_apply(&p, S_IFREG | 0011) == (S_IFREG | 0711));
+	mu_assert("X didn't make a dir searchable",
+	          perms_apply(&p, S_IFDIR | 0000) == (S_IFDIR | 0700));
+
+	mu_assert("perms_parse rejected go-w,o=r", !perms_parse(&p, "go-w,o=r"));
+	mu_assert("go-w,o=r gone wrong",
+	          perms_apply(&p, S_IFREG | 0777) == (S_IFREG | 0754));
+
+	mu_assert("perms_parse rejected u+r-w", !perms_parse(&p, "u+r-w"));
+	mu_assert("u+r-w gone wrong",
+	          perms_apply(&p, S_IFREG | 0200) == (S_IFREG | 0400));
+
+	mu_assert("perms_parse rejected +t,g+s", !perms_parse(&p, "+t,g+s"));
+	mu_assert("+t,g+s gone wrong",
+	          perms_apply(&p, S_IFDIR | 0755) == (S_IFDIR | 03755));
+
+	mu_assert("perms_parse rejected a=", !perms_parse(&p, "a="));
+	mu_assert("a= gone wrong", perms_apply(&p, S_IFREG | 06777) == S_IFREG);
+
+	for (i=0; i<BADSPECS; i++) {
+		mu_assert("perms_parse took a bad spec", perms_parse(&p, bad[i]) == EINVAL);
+	}
+
+	return NULL;
+}
+
+char *
+test_perms_owner()
+{
+	Perms p;
+
+	mu_assert("perms_parse rejected 0:0", !perms_parse(&p, "0:0"));
+	mu_assert("0:0 not parsed", p.uid == 0 && p.gid == 0 && !p.count[0]);
+	mu_assert("perms_parse rejected :12 u+x", !perms_parse(&p, ":12 u+x"));
+	mu_assert(":12 u+x not parsed", p.uid == (uid_t)-1 && p.gid == 12 &&
+	          p.count[0] == 1 && p.count[1] == 1);
+	mu_assert("perms_parse rejected 34:", !perms_parse(&p, "34:"));
+	mu_assert("34: not parsed", p.uid == 34 && p.gid == (gid_t)-1);
+	mu_assert("perms_parse found a made up user",
+	          perms_parse(&p, "no-such-user-hopefully:") == ENOENT);
+
+	return NULL;
+}
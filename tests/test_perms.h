@@ -0,0 +1,8 @@
+#ifndef TEST_PERMS_H
+#define TEST_PERMS_H
+
+char* test_perms_octal();
+char* test_perms_symbolic();
+char* test_perms_owner();
+
+#endif
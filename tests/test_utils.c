@@ -104,3 +104,54 @@ test_tohuman()
 	}
 	return NULL;
 }
+
+char *
+test_fromhuman()
+{
+	const char *valid[] = { "0", "512", "10K", "1.5 M", "2g" };
+	const unsigned long bytes[] = { 0, 512, 10000, 1500000, 2000000000 };
+	const char *invalid[] = { "", "M", "-1", "10X", "10MB" };
+	unsigned long val;
+	char buf[10];
+	int i;
+
+	for (i=0; i<5; i++) {
+		mu_assert("fromhuman rejected a size", !fromhuman(valid[i], &val));
+		mu_assert("fromhuman got a size wrong", val == bytes[i]);
+		mu_assert("fromhuman took garbage", fromhuman(invalid[i], &val));
+	}
+
+	/* What tohuman() writes can be read back, give or take rounding */
+	tohuman(123456789, buf);
+	mu_assert("fromhuman can't read tohuman", !fromhuman(buf, &val));
+	mu_assert("fromhuman misread tohuman", val == 123000000);
+	return NULL;
+}
+
+char *
+test_pct()
+{
+	const char *path = "/home/me/50% off/caf\xc3\xa9 #1.txt";
+	char buf[PATH_MAX], small[8];
+	FILE *fp;
+
+	mu_assert("pct_encode failed", !pct_encode(path, buf, sizeof(buf)));
+	mu_assert("pct_encode got it wrong",
+	          !strcmp(buf, "/home/me/50%25%20off/caf%C3%A9%20%231.txt"));
+	mu_assert("pct_decode failed", !pct_decode(buf));
+	mu_assert("pct_decode didn't round trip", !strcmp(buf, path));
+
+	mu_assert("pct_encode overflowed", pct_encode(path, small, sizeof(small)));
+	strcpy(buf, "bad%2");
+	mu_assert("pct_decode took garbage", pct_decode(buf));
+	strcpy(buf, "bad%zz");
+	mu_assert("pct_decode took garbage", pct_decode(buf));
+
+	mu_assert("tmpfile failed", (fp = tmpfile()));
+	mu_assert("pct_put failed", !pct_put(fp, "key ", "a b"));
+	rewind(fp);
+	mu_assert("pct_put wrote nothing", fgets(buf, sizeof(buf), fp));
+	fclose(fp);
+	mu_assert("pct_put got it wrong", !strcmp(buf, "key a%20b\n"));
+	return NULL;
+}
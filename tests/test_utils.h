@@ -6,5 +6,7 @@ char* test_join();
 char* test_strcasestr();
 char* test_strchomp();
 char* test_tohuman();
+char* test_fromhuman();
+char* test_pct();
 
 #endif